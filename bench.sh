@@ -0,0 +1,146 @@
+#!/bin/bash
+# Dispatch microbenchmarks. Each is run on builds with threaded and with
+# switch dispatch, with and without superinstructions, and once more
+# counting instructions, to give the time each takes per bytecode
+# instruction run and how often the fused ones hit. Then a benchmark of
+# symbol lookup as the number of globals grows, of fib once a global it
+# doesn't use has been rebound, with and without the nursery, of bignum
+# arithmetic, of list operations on 100k items, and of the memory taken
+# by a 1M-item list. Last, a check that a tail recursive
+# loop runs in constant stack, which fails the script if not.
+mkdir -p build/
+cc -std=c11 -Wall -Werror -O2 parsing.c mpc.c -ledit -lm -o build/parsing-threaded
+cc -std=c11 -Wall -Werror -O2 -DLISPY_SWITCH_DISPATCH parsing.c mpc.c -ledit -lm -o build/parsing-switch
+cc -std=c11 -Wall -Werror -O2 -DLISPY_VM_STATS parsing.c mpc.c -ledit -lm -o build/parsing-stats
+cc -std=c11 -Wall -Werror -O2 -DLVEC_MIN=INT_MAX parsing.c mpc.c -ledit -lm -o build/parsing-lists
+cc -std=c11 -Wall -Werror -O2 -DLISPY_NO_NURSERY parsing.c mpc.c -ledit -lm -o build/parsing-no-nursery
+
+TIMEFORMAT=%U
+for bench in dispatch_arith dispatch_list; do
+  echo "$bench:"
+  for fuse in "" --no-fuse; do
+    # Counts for each opcode, the last three fused, then the misses.
+    counts=$( (cat $bench.lispy; echo 'vm {}') | build/parsing-stats $fuse | tail -n 1 | tr -d '{}')
+    read total fused misses < <(echo $counts | awk '{
+      for (i = 1; i < NF; i++) { total += $i }
+      for (i = NF - 3; i < NF; i++) { fused += $i }
+      print total, fused, $NF }')
+    echo "  ${fuse:-fused} $total instructions {$counts}, $((fused - misses)) of $fused fused hit"
+    for build in threaded switch; do
+      # Best of three, in user time.
+      secs=$(for i in 1 2 3; do
+        { time build/parsing-$build $fuse < $bench.lispy > /dev/null; } 2>&1
+      done | sort -n | head -n 1)
+      awk -v b=$build -v s=$secs -v n=$total \
+        'BEGIN { printf "    %-8s %6.3fs %6.2f ns/instruction\n", b, s, s * 1e9 / n }'
+    done
+  done
+done
+
+# Best of three runs of a build on the file given first, in user time.
+best() {
+  input=$1; shift
+  for i in 1 2 3; do
+    { time "$@" < $input > /dev/null; } 2>&1
+  done | sort -n | head -n 1
+}
+
+# The same loop after defining 10 up to 10,000 globals, less the time
+# taken to define them.
+echo "lookup_bench:"
+for n in 10 100 1000 10000; do
+  { for i in $(seq $n); do echo "def {g$i} $i"; done
+    echo "def {glast} 1"; } > build/globals.lispy
+  cat build/globals.lispy lookup_bench.lispy > build/lookup_bench.lispy
+  setup=$(best build/globals.lispy build/parsing-threaded)
+  total=$(best build/lookup_bench.lispy build/parsing-threaded)
+  awk -v n=$n -v s=$setup -v t=$total \
+    'BEGIN { printf "  %5d globals %6.3fs\n", n, t - s }'
+done
+
+# Rebinding a global only costs code that folded it, so fib should run as
+# fast, with no fused or folded instructions missing, after an unrelated
+# "def" as before. Folding turned off for comparison.
+echo "fib_bench:"
+{ head -n 1 fib_bench.lispy; echo "def {x} 1"; echo "def {x} 2"
+  tail -n +2 fib_bench.lispy; } > build/fib_rebind.lispy
+for run in "fib_bench.lispy" "build/fib_rebind.lispy" "fib_bench.lispy --no-fold"; do
+  set -- $run
+  misses=$( (cat $1; echo 'vm {}') | build/parsing-stats $2 |
+    grep -o '{.*}' | tail -n 1 | tr -d '{}' | awk '{ print $NF }')
+  secs=$(best $1 build/parsing-threaded $2)
+  printf "  %-36s %6.3fs %8d misses\n" "$*" $secs $misses
+done
+
+# The same fib with temporaries bump allocated from the nursery, and with
+# each lval taken from and given back to the pool instead.
+echo "nursery_bench:"
+for build in threaded no-nursery; do
+  printf "  %-10s %6.3fs\n" $build $(best fib_bench.lispy build/parsing-$build)
+done
+
+# 10000! and 2^100000, which overflow a long early on and are carried on
+# in bignums.
+echo "bignum_bench:"
+printf "  %6.3fs\n" $(best bignum_bench.lispy build/parsing-threaded)
+
+# join, cons, head and "+" 100 times each over a 100k-item list, less the
+# time taken to build it, as a plain list with room to grow and a start
+# offset, and as a persistent vector.
+echo "list_bench:"
+setup_lists=$(best list_bench.lispy build/parsing-lists)
+setup_vecs=$(best list_bench.lispy build/parsing-threaded)
+for op in joins conses heads sums; do
+  { cat list_bench.lispy; echo "$op 100 big 0"; } > build/list_$op.lispy
+  lists=$(best build/list_$op.lispy build/parsing-lists)
+  vecs=$(best build/list_$op.lispy build/parsing-threaded)
+  awk -v op=$op -v sl=$setup_lists -v l=$lists -v sv=$setup_vecs -v v=$vecs \
+    'BEGIN { printf "  %-6s lists %7.3f ms/op, vectors %7.3f ms/op\n",
+             op, (l - sl) * 10, (v - sv) * 10 }'
+done
+
+# Peak resident memory, from GNU time, reading a 1M-item quoted list of
+# numbers, symbols or strings, less that of reading an empty one. Numbers
+# are held in the pointers, so only symbols and strings cost an lval each.
+# The peak includes mpc's parse tree, which is freed once the list is read.
+echo "memory_bench:"
+if [ -x /usr/bin/time ]; then
+  # The lists run to several MB each, so they aren't kept.
+  tmp=$(mktemp -d)
+  trap 'rm -rf "$tmp"' EXIT
+  maxrss() { /usr/bin/time -f %M build/parsing-threaded < $1 2>&1 > /dev/null |
+    tail -n 1; }
+  echo 'def {big} {}' > $tmp/empty.lispy
+  base=$(maxrss $tmp/empty.lispy)
+  for kind in numbers symbols strings; do
+    awk -v k=$kind 'BEGIN {
+      f = k == "numbers" ? "%d " : k == "symbols" ? "s%d " : "\"s%d\" "
+      printf "def {big} {"
+      for (i = 1; i <= 1000000; i++) { printf f, i }
+      print "}"; print "len big" }' > $tmp/$kind.lispy
+    kb=$(maxrss $tmp/$kind.lispy)
+    awk -v k=$kind -v kb=$kb -v b=$base \
+      'BEGIN { printf "  %-8s %7.1f MB, %5.1f bytes/item\n",
+               k, (kb - b) / 1024, (kb - b) * 1024 / 1e6 }'
+  done
+else
+  echo "  skipped, needs GNU time at /usr/bin/time"
+fi
+
+# 10M times round a loop written as tail recursion, under each scope and
+# way of evaluating, on the default 8MB stack. Nesting a C frame each time
+# would overflow it long before the end.
+echo "tail_loop:"
+failed=0
+for mode in "" --tree-walk --dynamic-scope "--dynamic-scope --tree-walk"; do
+  secs=$( { time (ulimit -s 8192; build/parsing-threaded $mode \
+      < tail_loop.lispy > build/tail_loop.out 2>&1); } 2>&1)
+  result=$(grep -o '[0-9]*$' build/tail_loop.out | tail -n 1)
+  if [ "$result" = 10000000 ]; then
+    printf "  %-28s %6.3fs ok\n" "${mode:-lexical}" $secs
+  else
+    printf "  %-28s FAILED, got \"%s\"\n" "${mode:-lexical}" "$result"
+    failed=1
+  fi
+done
+exit $failed
@@ -1,3 +1,4 @@
 #!/bin/bash
 mkdir -p build/
 cc -std=c11 -Wall -Werror -g parsing.c mpc.c -ledit -lm -o build/parsing
+cc -std=c11 -Wall -Werror -g lispyc.c mpc.c -ledit -lm -o build/lispyc
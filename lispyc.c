@@ -0,0 +1,390 @@
+/* lispyc: compile a Lispy program to C.
+
+     build/lispyc prog.lispy > prog.c
+     cc -std=c11 -I. prog.c mpc.c -ledit -lm -o prog
+
+   The program is read a line at a time, as the REPL would, and each line's
+   value is printed when it runs. The C includes parsing.c whole, without
+   its main, so calls go straight to the builtins and the runtime. See
+   "Ahead of time compilation" there for what the generated code relies
+   on. */
+#define _POSIX_C_SOURCE 200809L
+#define LISPY_NO_MAIN
+#include "parsing.c"
+
+#include <errno.h>
+#include <stdarg.h>
+
+/* A growing string of generated C. */
+typedef struct lcbuf {
+  char* s;
+  size_t len;
+  size_t cap;
+} lcbuf;
+
+void lcbuf_printf(lcbuf* b, char* fmt, ...) {
+  va_list va;
+  va_start(va, fmt);
+  int n = vsnprintf(NULL, 0, fmt, va);
+  va_end(va);
+
+  if (b->len + n + 1 > b->cap) {
+    while (b->len + n + 1 > b->cap) { b->cap = b->cap ? b->cap * 2 : 256; }
+    b->s = realloc(b->s, b->cap);
+  }
+
+  va_start(va, fmt);
+  vsnprintf(b->s + b->len, n + 1, fmt, va);
+  va_end(va);
+  b->len += n;
+}
+
+/* The whole program being compiled. */
+struct {
+  /* The source of each literal, read in by the program at startup. */
+  char** consts;
+  int nconsts;
+  /* Every function but main, and how many of them are lambdas. */
+  lcbuf defs;
+  int nlambdas;
+} lc;
+
+/* The function being compiled. */
+typedef struct lcfn {
+  lcbuf body;
+  /* The names of the lambda's formals, which live in its frame, and
+     whether each is used. */
+  char** locals;
+  int* used;
+  int nlocals;
+  int temps;
+  int indent;
+} lcfn;
+
+/* The index of the literal with source "src", added if it is new. */
+int lc_const(char* src) {
+  for (int i = 0; i < lc.nconsts; i++) {
+    if (strcmp(lc.consts[i], src) == 0) { return i; }
+  }
+  lc.consts = realloc(lc.consts, sizeof(char*) * (lc.nconsts + 1));
+  lc.consts[lc.nconsts] = strcpy(malloc(strlen(src) + 1), src);
+  return lc.nconsts++;
+}
+
+/* Whether the node "t" is punctuation or a comment, which lval_read
+   skips too. */
+int lc_skip(mpc_ast_t* t) {
+  return strcmp(t->contents, "(") == 0 || strcmp(t->contents, ")") == 0 ||
+    strcmp(t->contents, "{") == 0 || strcmp(t->contents, "}") == 0 ||
+    strcmp(t->tag, "regex") == 0 || strstr(t->tag, "comment") != NULL;
+}
+
+/* The expressions under "t", with their count in "*n". */
+mpc_ast_t** lc_items(mpc_ast_t* t, int* n) {
+  mpc_ast_t** items = malloc(sizeof(mpc_ast_t*) * (t->children_num + 1));
+  *n = 0;
+  for (int i = 0; i < t->children_num; i++) {
+    if (!lc_skip(t->children[i])) { items[(*n)++] = t->children[i]; }
+  }
+  return items;
+}
+
+int lc_is(mpc_ast_t* t, char* tag) { return strstr(t->tag, tag) != NULL; }
+
+/* Write the source of "t" back out, which reads in as the same value. */
+void lc_source(lcbuf* b, mpc_ast_t* t) {
+  if (lc_is(t, "number") || lc_is(t, "symbol") || lc_is(t, "string")) {
+    lcbuf_printf(b, "%s", t->contents);
+    return;
+  }
+
+  int n;
+  mpc_ast_t** items = lc_items(t, &n);
+  lcbuf_printf(b, lc_is(t, "qexpr") ? "{" : "(");
+  for (int i = 0; i < n; i++) {
+    if (i) { lcbuf_printf(b, " "); }
+    lc_source(b, items[i]);
+  }
+  lcbuf_printf(b, lc_is(t, "qexpr") ? "}" : ")");
+  free(items);
+}
+
+/* The literal for the node "t", or for an empty S-expression if NULL. */
+int lc_literal(mpc_ast_t* t) {
+  lcbuf b = { NULL, 0, 0 };
+  if (t) { lc_source(&b, t); } else { lcbuf_printf(&b, "()"); }
+  int i = lc_const(b.s);
+  free(b.s);
+  return i;
+}
+
+int lc_local(lcfn* f, char* name) {
+  for (int i = 0; i < f->nlocals; i++) {
+    if (strcmp(f->locals[i], name) == 0) { return i; }
+  }
+  return -1;
+}
+
+/* Whether "t" is the symbol "name", and not a local that hides it. */
+int lc_is_sym(lcfn* f, mpc_ast_t* t, char* name) {
+  return lc_is(t, "symbol") && strcmp(t->contents, name) == 0 &&
+    lc_local(f, name) < 0;
+}
+
+void lc_line(lcfn* f, char* fmt, ...) {
+  lcbuf_printf(&f->body, "%*s", f->indent * 2, "");
+  va_list va;
+  va_start(va, fmt);
+  int n = vsnprintf(NULL, 0, fmt, va);
+  va_end(va);
+  char* s = malloc(n + 1);
+  va_start(va, fmt);
+  vsnprintf(s, n + 1, fmt, va);
+  va_end(va);
+  lcbuf_printf(&f->body, "%s\n", s);
+  free(s);
+}
+
+void lc_expr(lcfn* f, mpc_ast_t* t, char* dst, int tail);
+int lc_lambda(mpc_ast_t* formals, mpc_ast_t* body);
+
+/* Emit code setting "dst" to the value of the "n" expressions at "items"
+   evaluated as an S-expression. In tail position, "tail", a call may be
+   handed back in "next" instead. */
+void lc_sexpr(lcfn* f, mpc_ast_t** items, int n, char* dst, int tail) {
+  if (n == 0) {
+    lc_line(f, "%s = lval_copy(k[%i]);", dst, lc_literal(NULL));
+    return;
+  }
+  if (n == 1) {
+    lc_expr(f, items[0], dst, tail);
+    return;
+  }
+
+  int t = f->temps++;
+  char item[32];
+  lc_line(f, "{");
+  f->indent++;
+  lc_line(f, "lval* t%i[%i];", t, n);
+
+  /* A lambda written out in full has its body compiled. */
+  if (n == 3 && lc_is_sym(f, items[0], "\\") && lc_is(items[1], "qexpr") &&
+      lc_is(items[2], "qexpr")) {
+    int id = lc_lambda(items[1], items[2]);
+    if (id >= 0) {
+      lc_line(f, "t%i[0] = lenv_get(e, k[%i]);", t, lc_literal(items[0]));
+      lc_line(f, "t%i[1] = lval_copy(k[%i]);", t, lc_literal(items[1]));
+      lc_line(f, "t%i[2] = lval_copy(k[%i]);", t, lc_literal(items[2]));
+      lc_line(f, "%s = laot_lambda(e, t%i, lambda_%i);", dst, t, id);
+      f->indent--;
+      lc_line(f, "}");
+      return;
+    }
+  }
+
+  /* So is an "if" whose branches are written out, if it is still the
+     builtin and its condition is a number. Anything else, errors
+     included, is left to the builtin. */
+  int branch = n == 4 && lc_is_sym(f, items[0], "if") &&
+    lc_is(items[2], "qexpr") && lc_is(items[3], "qexpr");
+  for (int i = 0; i < (branch ? 2 : n); i++) {
+    snprintf(item, sizeof(item), "t%i[%i]", t, i);
+    lc_expr(f, items[i], item, 0);
+  }
+
+  if (branch) {
+    lc_line(f, "if (laot_is_if(t%i[0], t%i[1])) {", t, t);
+    f->indent++;
+    lc_line(f, "int taken = lnum_is_true(t%i[1]);", t);
+    lc_line(f, "lval_del(t%i[0]);", t);
+    lc_line(f, "lval_del(t%i[1]);", t);
+    for (int b = 2; b < 4; b++) {
+      lc_line(f, b == 2 ? "if (taken) {" : "} else {");
+      f->indent++;
+      int m;
+      mpc_ast_t** body = lc_items(items[b], &m);
+      lc_sexpr(f, body, m, dst, tail);
+      free(body);
+      f->indent--;
+    }
+    lc_line(f, "}");
+    f->indent--;
+    lc_line(f, "} else {");
+    f->indent++;
+    for (int i = 2; i < 4; i++) {
+      lc_line(f, "t%i[%i] = lval_copy(k[%i]);", t, i, lc_literal(items[i]));
+    }
+  }
+
+  if (tail) {
+    lc_line(f, "%s = laot_tail(e, t%i, %i, next);", dst, t, n);
+  } else {
+    lc_line(f, "%s = laot_call(e, t%i, %i);", dst, t, n);
+  }
+
+  if (branch) {
+    f->indent--;
+    lc_line(f, "}");
+  }
+  f->indent--;
+  lc_line(f, "}");
+}
+
+/* Emit code setting "dst" to the value of the expression "t". */
+void lc_expr(lcfn* f, mpc_ast_t* t, char* dst, int tail) {
+  if (lc_is(t, "number") && !strchr(t->contents, '.')) {
+    errno = 0;
+    long x = strtol(t->contents, NULL, 10);
+    if (errno != ERANGE && x >= LVAL_INT_MIN && x <= LVAL_INT_MAX) {
+      lc_line(f, "%s = lval_num(%ldL);", dst, x);
+      return;
+    }
+  }
+
+  if (lc_is(t, "symbol")) {
+    int i = lc_local(f, t->contents);
+    if (i >= 0) {
+      f->used[i] = 1;
+      lc_line(f, "%s = lval_copy(e->vals[s%i]);", dst, i);
+    } else {
+      lc_line(f, "%s = lenv_get(e, k[%i]);", dst, lc_literal(t));
+    }
+    return;
+  }
+
+  if (lc_is(t, "sexpr")) {
+    int n;
+    mpc_ast_t** items = lc_items(t, &n);
+    lc_sexpr(f, items, n, dst, tail);
+    free(items);
+    return;
+  }
+
+  lc_line(f, "%s = lval_copy(k[%i]);", dst, lc_literal(t));
+}
+
+/* Compile the body of the lambda with "formals" to "lambda_N", and return
+   N, or -1 if the formals aren't all symbols. */
+int lc_lambda(mpc_ast_t* formals, mpc_ast_t* body) {
+  int n;
+  mpc_ast_t** syms = lc_items(formals, &n);
+  lcfn f = { { NULL, 0, 0 }, malloc(sizeof(char*) * (n + 1)),
+              calloc(n + 1, sizeof(int)), 0, 0, 1 };
+  for (int i = 0; i < n; i++) {
+    if (!lc_is(syms[i], "symbol")) {
+      free(syms);
+      free(f.locals);
+      free(f.used);
+      return -1;
+    }
+    if (strcmp(syms[i]->contents, "&") != 0) {
+      f.locals[f.nlocals++] = syms[i]->contents;
+    }
+  }
+  free(syms);
+
+  int id = lc.nlambdas++;
+  int m;
+  mpc_ast_t** items = lc_items(body, &m);
+  lc_sexpr(&f, items, m, "r", 1);
+  free(items);
+
+  /* Locals are found in the frame once, by name, as what else the frame
+     holds depends on what the lambda captured. */
+  lcbuf_printf(&lc.defs, "static lval* lambda_%i(lenv* e, lval** next) {\n",
+               id);
+  for (int i = 0; i < f.nlocals; i++) {
+    if (!f.used[i]) { continue; }
+    lcbuf_printf(&lc.defs, "  int s%i = laot_slot(e, k[%i]);\n", i,
+                 lc_const(f.locals[i]));
+  }
+  lcbuf_printf(&lc.defs, "  lval* r;\n%s  return r;\n}\n\n", f.body.s);
+  free(f.body.s);
+  free(f.locals);
+  free(f.used);
+  return id;
+}
+
+/* Compile the line "t", the "n"th, to "line_N". */
+void lc_toplevel(mpc_ast_t* t, int n) {
+  lcfn f = { { NULL, 0, 0 }, NULL, NULL, 0, 0, 1 };
+  lcbuf_printf(&f.body, "  lval* r;\n");
+
+  int m;
+  mpc_ast_t** items = lc_items(t, &m);
+  lc_sexpr(&f, items, m, "r", 0);
+  free(items);
+
+  lcbuf_printf(&lc.defs, "static lval* line_%i(lenv* e) {\n", n);
+  lcbuf_printf(&lc.defs, "%s  return r;\n}\n\n", f.body.s);
+  free(f.body.s);
+}
+
+/* Write "s" as a C string literal. */
+void lc_cstring(FILE* out, char* s) {
+  fputc('"', out);
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\') { fputc('\\', out); }
+    if (*s == '\n') { fputs("\\n", out); continue; }
+    fputc(*s, out);
+  }
+  fputc('"', out);
+}
+
+int main(int argc, char** argv) {
+  if (argc != 2) {
+    fprintf(stderr, "Usage: lispyc file.lispy > file.c\n");
+    return 1;
+  }
+
+  FILE* in = fopen(argv[1], "r");
+  if (!in) {
+    fprintf(stderr, "Could not open \"%s\".\n", argv[1]);
+    return 1;
+  }
+
+  char* input = NULL;
+  size_t size = 0;
+  ssize_t len;
+  int lines = 0;
+  int ok = 1;
+  while ((len = getline(&input, &size, in)) >= 0) {
+    if (len && input[len - 1] == '\n') { input[len - 1] = '\0'; }
+
+    mpc_result_t r;
+    if (!mpc_parse(argv[1], input, lgrammar(), &r)) {
+      mpc_err_print_to(r.error, stderr);
+      mpc_err_delete(r.error);
+      ok = 0;
+      continue;
+    }
+    lc_toplevel(r.output, lines++);
+    mpc_ast_delete(r.output);
+  }
+  free(input);
+  fclose(in);
+  lgrammar_cleanup();
+  if (!ok) { return 1; }
+
+  printf("/* Compiled by lispyc from %s. */\n", argv[1]);
+  printf("#define LISPY_NO_MAIN\n#include \"parsing.c\"\n\n");
+  printf("static lval* k[%i];\n\n", lc.nconsts ? lc.nconsts : 1);
+  for (int i = 0; i < lc.nlambdas; i++) {
+    printf("static lval* lambda_%i(lenv* e, lval** next);\n", i);
+  }
+  if (lc.nlambdas) { printf("\n"); }
+  fwrite(lc.defs.s, 1, lc.defs.len, stdout);
+
+  printf("int main(void) {\n  lenv* e = laot_init();\n");
+  for (int i = 0; i < lc.nconsts; i++) {
+    printf("  k[%i] = laot_read(e, ", i);
+    lc_cstring(stdout, lc.consts[i]);
+    printf(");\n");
+  }
+  printf("\n");
+  for (int i = 0; i < lines; i++) {
+    printf("  laot_print(line_%i(e));\n", i);
+  }
+  printf("\n  laot_done(e, k, %i);\n  return 0;\n}\n", lc.nconsts);
+  return 0;
+}
@@ -1,8 +1,22 @@
+#ifdef LISPY_JIT
+#define _DEFAULT_SOURCE
+#endif
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
 #include <math.h>
+#include <time.h>
 #include <editline/readline.h>
 #include <editline/history.h>
+#ifdef LISPY_JIT
+#ifndef __x86_64__
+#error "LISPY_JIT generates x86-64 code."
+#endif
+#include <setjmp.h>
+#include <sys/mman.h>
+#endif
 #include "mpc.h"
 
 #define LASSERT(args, cond, fmt, ...) \
@@ -13,157 +27,1660 @@
   }
 
 #define LASSERT_ARG_COUNT(v, c, fn) \
-  LASSERT(v, v->data.sexprs.count == c, \
+  LASSERT(v, v->data.sexprs->count == c, \
           "\"%s\" expected %i arguments, got %i.", \
-          fn, c, v->data.sexprs.count);
+          fn, c, v->data.sexprs->count);
 
 #define LASSERT_ARG_TYPE(v, arg_num, expect_type, fn) {\
-  int arg_type = v->data.sexprs.cell[(arg_num)]->type; \
+  int arg_type = lval_type(v->data.sexprs->cell[(arg_num)]); \
   LASSERT(v, arg_type == expect_type, \
           "\"%s\" expected \"%s\", got \"%s\" for arg %i.", \
           fn, ltype_name(expect_type), ltype_name(arg_type), arg_num) };
 
 #define LASSERT_ARG_NOT_EMPTY_LIST(v, arg_num, fn) \
-  LASSERT(v, v->data.sexprs.cell[arg_num]->data.sexprs.count > 0, \
+  LASSERT(v, lval_len(v->data.sexprs->cell[arg_num]) > 0, \
           "\"%s\" was passed {}.", fn);
 
+/* The same checks, for builtins that are passed their arguments as "argv"
+   and "argc" and so have nothing to delete. */
+#define LCHECK(cond, fmt, ...) \
+  if (!(cond)) { return lval_err(fmt, ##__VA_ARGS__); }
+
+#define LCHECK_ARG_COUNT(argc, c, fn) \
+  LCHECK(argc == c, "\"%s\" expected %i arguments, got %i.", fn, c, argc);
+
+#define LCHECK_ARG_TYPE(argv, arg_num, expect_type, fn) {\
+  int arg_type = lval_type(argv[(arg_num)]); \
+  LCHECK(arg_type == expect_type, \
+         "\"%s\" expected \"%s\", got \"%s\" for arg %i.", \
+         fn, ltype_name(expect_type), ltype_name(arg_type), arg_num) };
+
+#define LCHECK_ARG_NOT_EMPTY_LIST(argv, arg_num, fn) \
+  LCHECK(lval_len(argv[arg_num]) > 0, "\"%s\" was passed {}.", fn);
+
 struct lval;
 struct lenv;
 typedef struct lval lval;
 typedef struct lenv lenv;
 
 /* Lisp value definitions. */
-enum { LVAL_ERR, LVAL_NUM, LVAL_STR, LVAL_SYM, LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR };
+enum { LVAL_ERR, LVAL_NUM, LVAL_STR, LVAL_SYM, LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR,
+       LVAL_VEC, LVAL_BIG, LVAL_DBL };
+
+/* Symbol hints, see lval_resolve. A hint is a slot in the current frame
+   or, with LSYM_GLOBAL set, in the global one. */
+#define LSYM_FREE 0xffff
+#define LSYM_GLOBAL 0x8000
+#define LSYM_SLOT_MAX 0x7fff
+
+/* Interpreter options, set from the command line. */
+struct {
+  /* Link call frames to the caller's environment rather than the global
+     one, as lambdas did before they captured their free variables. */
+  int dynamic_scope;
+
+  /* Evaluate lambda bodies by walking the tree, rather than compiling
+     them to bytecode, see lcode_compile. */
+  int tree_walk;
+
+  /* Compile without superinstructions, see lcode_fuse. */
+  int no_fuse;
+
+  /* Compile lambda bodies without folding constants, see lfold_value, or
+     print each body as folded when the lambda is made. */
+  int no_fold;
+  int dump_fold;
+} lopts;
 
 typedef lval*(*lbuiltin)(lenv*, lval*);
 
-/* lval type definition. */
+/* Builtins can instead be passed their arguments where they already are,
+   as "argc" values from "argv". These still belong to the caller, see
+   largv_take, and may be on the VM's stack, so a builtin like this mustn't
+   evaluate anything. */
+typedef lval*(*lbuiltin_argv)(lenv*, lval** argv, int argc);
+
+typedef struct lcode lcode;
+
+/* A lambda body compiled to C by lispyc, run in the call's frame "e". It
+   returns the value of the body, or NULL with "*next" set to the evaluated
+   S-expression of a tail call for laot_run to make in its place. */
+typedef lval*(*laot_body)(lenv* e, lval** next);
+
+/* A function's payload, kept out of line so it doesn't widen every lval.
+   A lambda never changes once made: a call binds its arguments into a
+   fresh frame, see lframe_bind. */
+typedef struct lfun {
+  lbuiltin builtin;
+  lbuiltin_argv builtin_argv;
+  /* Values the lambda captured when it was made. */
+  lenv* env;
+  lval* formals;
+  lval* body;
+  /* The body compiled to bytecode, or NULL to walk it. */
+  lcode* code;
+  /* The body compiled ahead of time by lispyc, or NULL. */
+  laot_body aot;
+  /* For a partial application, the lambda and the arguments given to it
+     so far. It has no env or code of its own, and its formals and body
+     are the lambda's, less the formals already given. */
+  lval* callee;
+  lval* args;
+} lfun;
+
+static inline int lfun_is_builtin(lfun* fn) {
+  return fn->builtin || fn->builtin_argv;
+}
+
+/* The items of an S or Q-expression. "cell" points at the first of
+   "count" items somewhere in "items", which has room for "capacity". Items
+   are popped off the front by moving "cell" along.
+
+   A slice has no items of its own. Its "cell" points into those of "base",
+   which holds the references and is freed once "refs", counting its own
+   lval and every slice of it, drops to zero. Items are only changed in
+   place while nothing else shares them, see lval_unshare. */
+typedef struct lcells {
+  int count;
+  int capacity;
+  int refs;
+  lval** cell;
+  struct lcells* base;
+#ifdef LISPY_GC
+  /* Link in the list of blocks an lgc_collect will free. */
+  struct lcells* gc_next;
+#endif
+  lval* items[];
+} lcells;
+
+/* Long Q-expressions are stored as persistent vectors, LVAL_VEC, which is
+   a Q-expression as far as Lispy code can tell. A vector is a tree of
+   nodes with up to LVEC_WIDTH items or children, every leaf at the same
+   depth. Nodes are never changed once built, so versions made by cons,
+   join, head, tail and init share all but O(log N) of them. Lists are
+   turned into vectors when joined past LVEC_MIN items, and back into
+   plain lists below LVEC_FLAT. Build with -DLVEC_MIN=INT_MAX to keep
+   every list plain. */
+#define LVEC_WIDTH 32
+#ifndef LVEC_MIN
+#define LVEC_MIN 1024
+#endif
+#define LVEC_FLAT 256
+
+typedef struct lvnode {
+  int refs;
+  /* Zero for a leaf. */
+  int height;
+  /* Number of items or children in this node, and items under it. */
+  int count;
+  int size;
+  /* Whether everything under this node is out of the nursery. */
+  int tenured;
+#ifdef LISPY_GC
+  unsigned gc_mark;
+  struct lvnode* gc_next;
+#endif
+  union {
+    lval* items[LVEC_WIDTH];
+    struct lvnode* kids[LVEC_WIDTH];
+  };
+} lvnode;
+
+/* Bytecode for a lambda body, see lcode_compile. Instructions are ints,
+   an opcode followed by its operands. Shared between copies of the
+   function, as it never changes. */
+enum { LOP_CONST, LOP_LOAD, LOP_APPLY, LOP_TAIL, LOP_IF, LOP_JUMP, LOP_RET,
+       LOP_FOLD, LOP_CALL1, LOP_CALL2, LOP_IF_CALL2, LOP_COUNT };
+
+#ifdef LISPY_JIT
+/* Native code for a lambda body, see ljit_compile. */
+typedef struct ljit {
+  void* code;
+  size_t size;
+  int nargs;
+  /* The names the code calls, with what each meant when compiled. */
+  int nguards;
+  struct { char* name; int op; }* guards;
+} ljit;
+#endif
+
+typedef struct lcode {
+  int refs;
+  int count;
+  int* ops;
+  /* Literals and symbols the instructions refer to, by index. */
+  int nconsts;
+  lval** consts;
+  /* Deepest the operand stack gets. */
+  int max_stack;
+  /* The global names folding relied on, with the lsym_version each had,
+     and the lfold_epoch they were last found to still hold in. While
+     compiling, what folding may assume, if anything. */
+  int nguards;
+  struct { char* sym; long version; }* guards;
+  long checked;
+  struct lfold* fold;
+#ifdef LISPY_JIT
+  /* Calls so far, and the native code once there have been enough. */
+  int calls;
+  ljit* jit;
+#endif
+#ifdef LISPY_GC
+  unsigned gc_mark;
+  struct lcode* gc_next;
+#endif
+} lcode;
+
+/* Moved on whenever a global is rebound, or hidden behind a local, so
+   that code compiled before checks whether the names it folded were among
+   them, see lvm_folds_hold. */
+_Thread_local long lfold_epoch;
+
+/* Numbers that don't fit in a long are LVAL_BIG, which is a Number as far
+   as Lispy code can tell. They are only made when arithmetic on longs
+   overflows, and any result that fits a long goes back to being one, so a
+   bignum never holds a value a long could. The magnitude is in base 2^32,
+   least significant limb first, with no leading zero limbs. */
+typedef struct lbig {
+  int sign;
+  int count;
+  uint32_t limbs[];
+} lbig;
+
+/* lval type definition. Anything that doesn't fit in a word lives out of
+   line, so that an lval is only 16 bytes. */
 typedef struct lval {
-  int type;
+  unsigned char type;
+
+  /* Whether this lval was allocated in the nursery. */
+  unsigned char young;
+
+  /* For symbols, where the resolver expects to find the binding. */
+  unsigned short hint;
+
+  /* Number of owners. Values are shared rather than copied, and are only
+     mutated in place once lval_unshare has made them private. */
+  int refs;
+
+#ifdef LISPY_GC
+  /* Links in the list of every allocated lval, and the collection that
+     last found this one reachable. */
+  struct lval* gc_prev;
+  struct lval* gc_next;
+  unsigned gc_mark;
+#endif
+
   union {
     /* Values */
     long num;
-    char* sym;
+    lbig* big;
+    double dbl;
     char* err;
     char* str;
+    char* sym;
+
+    /* A function */
+    lfun* fn;
+
+    /* List of more sexprs. */
+    lcells* sexprs;
+    lvnode* vec;
+  } data;
+} lval;
+
+/* Small integers aren't allocated at all. They live in the lval pointer
+   itself, shifted up one bit with the low bit set, which no real lval
+   pointer has. Only numbers outside that range are boxed as LVAL_NUM. */
+#define LVAL_INT_MIN (LONG_MIN / 2)
+#define LVAL_INT_MAX (LONG_MAX / 2)
+#define LVAL_IS_INT(v) ((uintptr_t)(v) & 1)
+
+static inline int lval_type(lval* v) {
+  if (LVAL_IS_INT(v)) { return LVAL_NUM; }
+  if (v->type == LVAL_BIG || v->type == LVAL_DBL) { return LVAL_NUM; }
+  return v->type == LVAL_VEC ? LVAL_QEXPR : v->type;
+}
+
+static inline int lval_is_big(lval* v) {
+  return !LVAL_IS_INT(v) && v->type == LVAL_BIG;
+}
+
+/* Numbers with a decimal point are LVAL_DBL, and arithmetic with any of
+   them in it is done in double precision. */
+static inline int lval_is_dbl(lval* v) {
+  return !LVAL_IS_INT(v) && v->type == LVAL_DBL;
+}
+
+/* Whether "v" is a Number that fits in a long, see lval_long. */
+static inline int lval_is_long(lval* v) {
+  return LVAL_IS_INT(v) || v->type == LVAL_NUM;
+}
+
+static inline long lval_long(lval* v) {
+  return LVAL_IS_INT(v) ? (long)((intptr_t)v >> 1) : v->data.num;
+}
+
+#ifdef LISPY_GC
+/* Tracing collector state, see lgc_collect. */
+struct {
+  lval* heap;
+  long objects;
+  long allocated;
+  long threshold;
+  unsigned epoch;
+
+  /* Statistics, as reported by the "gc" builtin. */
+  long collections;
+  long freed;
+  double pause_total;
+  double pause_max;
+  long live_bytes;
+
+  /* Item blocks and vector nodes whose last owner was found dead, freed
+     after the sweep. */
+  struct lcells* doomed;
+  struct lvnode* doomed_nodes;
+  struct lcode* doomed_code;
+} lgc = { .threshold = 1 << 16 };
+#endif
+
+/* Pools of fixed size objects. Objects are carved out of large slabs and
+   recycled through a free list, so allocating is a pop and freeing is a
+   push, and objects allocated together sit next to each other. Slabs are
+   never given back. Pools are per thread, so need no locking. Build with
+   -DLISPY_ALLOC_STATS to count what each pool does. */
+#define LPOOL_SLAB (64 * 1024)
+
+typedef struct lpool {
+  size_t size;
+  void* free;
+  char* top;
+  char* end;
+#ifdef LISPY_ALLOC_STATS
+  long allocs;
+  long frees;
+  long slabs;
+#endif
+} lpool;
+
+void* lpool_alloc(lpool* p) {
+#ifdef LISPY_ALLOC_STATS
+  p->allocs++;
+#endif
+  if (p->free) {
+    void* x = p->free;
+    p->free = *(void**)x;
+    return x;
+  }
+
+  if (p->top + p->size > p->end) {
+    p->top = malloc(LPOOL_SLAB);
+    p->end = p->top + LPOOL_SLAB;
+#ifdef LISPY_ALLOC_STATS
+    p->slabs++;
+#endif
+  }
+
+  void* x = p->top;
+  p->top += p->size;
+  return x;
+}
+
+void lpool_free(lpool* p, void* x) {
+#ifdef LISPY_ALLOC_STATS
+  p->frees++;
+#endif
+  *(void**)x = p->free;
+  p->free = x;
+}
+
+/* Pool for lvals outside the nursery, and for function payloads. */
+_Thread_local lpool lval_pool = { sizeof(lval) };
+_Thread_local lpool lfun_pool = { sizeof(lfun) };
+_Thread_local lpool lvnode_pool = { sizeof(lvnode) };
+
+#ifndef LISPY_NO_NURSERY
+/* Nursery. Most lvals die within the call that made them, so rather than
+   going through malloc they are bump allocated from fixed size chunks.
+   Each chunk counts the lvals still alive in it, and once that drops to
+   zero the chunk is reset by moving its top back to the start. Values
+   bound in the global environment are promoted out to the pool, see
+   lval_tenure, so that definitions don't pin chunks forever. If every
+   chunk is pinned, lvals come from the pool until one drains. */
+#define LNURSERY_CHUNK (16 * 1024)
+#define LNURSERY_MAX_CHUNKS 1024
+
+typedef struct lchunk {
+  struct lchunk* next;
+  long live;
+  char* top;
+} lchunk;
+
+/* The chunk header takes up the first few lval slots. */
+#define LCHUNK_HEADER \
+  ((sizeof(lchunk) + sizeof(lval) - 1) / sizeof(lval) * sizeof(lval))
+#define LCHUNK_START(c) ((char*)(c) + LCHUNK_HEADER)
+#define LCHUNK_END(c) ((char*)(c) + LNURSERY_CHUNK)
+
+struct {
+  lchunk* current;
+  /* Drained chunks, ready to be reused. */
+  lchunk* free;
+  int chunks;
+  /* Set while promoting, so that copies are made in the pool. */
+  int tenuring;
+} lnursery;
+
+lchunk* lnursery_refill(void) {
+  lchunk* c = lnursery.current;
+  if (c && c->live == 0) {
+    c->top = LCHUNK_START(c);
+    return c;
+  }
+
+  if (lnursery.free) {
+    c = lnursery.free;
+    lnursery.free = c->next;
+  } else if (lnursery.chunks < LNURSERY_MAX_CHUNKS) {
+    c = aligned_alloc(LNURSERY_CHUNK, LNURSERY_CHUNK);
+    if (!c) { return NULL; }
+    lnursery.chunks++;
+  } else {
+    return NULL;
+  }
+
+  c->live = 0;
+  c->top = LCHUNK_START(c);
+  lnursery.current = c;
+  return c;
+}
+
+lval* lnursery_alloc(void) {
+  if (lnursery.tenuring) { return NULL; }
+
+  lchunk* c = lnursery.current;
+  if (!c || c->top + sizeof(lval) > LCHUNK_END(c)) {
+    c = lnursery_refill();
+    if (!c) { return NULL; }
+  }
+
+  lval* v = (lval*)c->top;
+  c->top += sizeof(lval);
+  c->live++;
+  return v;
+}
+
+void lnursery_free(lval* v) {
+  lchunk* c = (lchunk*)((uintptr_t)v & ~(uintptr_t)(LNURSERY_CHUNK - 1));
+  if (--c->live > 0) { return; }
+
+  if (c == lnursery.current) {
+    c->top = LCHUNK_START(c);
+  } else {
+    c->next = lnursery.free;
+    lnursery.free = c;
+  }
+}
+#endif
+
+/* lval constructors and destructor */
+lval* lval_new(int type) {
+#ifndef LISPY_NO_NURSERY
+  lval* v = lnursery_alloc();
+  if (v) {
+    v->young = 1;
+  } else {
+    v = lpool_alloc(&lval_pool);
+    v->young = 0;
+  }
+#else
+  lval* v = lpool_alloc(&lval_pool);
+  v->young = 0;
+#endif
+  v->type = type;
+  v->refs = 1;
+#ifdef LISPY_GC
+  v->gc_mark = lgc.epoch;
+  v->gc_prev = NULL;
+  v->gc_next = lgc.heap;
+  if (lgc.heap) { lgc.heap->gc_prev = v; }
+  lgc.heap = v;
+  lgc.objects++;
+  lgc.allocated++;
+#endif
+  return v;
+}
+
+void lval_dealloc(lval* v) {
+#ifndef LISPY_NO_NURSERY
+  if (v->young) {
+    lnursery_free(v);
+    return;
+  }
+#endif
+  lpool_free(&lval_pool, v);
+}
+
+/* Release the lval struct itself, once its contents are gone. */
+void lval_free(lval* v) {
+#ifdef LISPY_GC
+  if (v->gc_prev) { v->gc_prev->gc_next = v->gc_next; }
+  else { lgc.heap = v->gc_next; }
+  if (v->gc_next) { v->gc_next->gc_prev = v->gc_prev; }
+  lgc.objects--;
+#endif
+  lval_dealloc(v);
+}
+
+lval* lval_num(long x) {
+  if (x >= LVAL_INT_MIN && x <= LVAL_INT_MAX) {
+    return (lval*)(((uintptr_t)x << 1) | 1);
+  }
+
+  lval* v = lval_new(LVAL_NUM);
+  v->data.num = x;
+  return v;
+}
+
+lval* lval_dbl(double x) {
+  lval* v = lval_new(LVAL_DBL);
+  v->data.dbl = x;
+  return v;
+}
+
+lval* lval_fun(lbuiltin func) {
+  lval* v = lval_new(LVAL_FUN);
+  v->data.fn = lpool_alloc(&lfun_pool);
+  v->data.fn->builtin = func;
+  v->data.fn->builtin_argv = NULL;
+  return v;
+}
+
+lval* lval_fun_argv(lbuiltin_argv func) {
+  lval* v = lval_new(LVAL_FUN);
+  v->data.fn = lpool_alloc(&lfun_pool);
+  v->data.fn->builtin = NULL;
+  v->data.fn->builtin_argv = func;
+  return v;
+}
+
+lenv* lenv_new(void);
+
+lval* lval_lambda(lval* formals, lval* body) {
+  lval* v = lval_new(LVAL_FUN);
+  v->data.fn = lpool_alloc(&lfun_pool);
+  v->data.fn->builtin = NULL;
+  v->data.fn->builtin_argv = NULL;
+  v->data.fn->env = lenv_new();
+  v->data.fn->formals = formals;
+  v->data.fn->body = body;
+  v->data.fn->code = NULL;
+  v->data.fn->aot = NULL;
+  v->data.fn->callee = NULL;
+  v->data.fn->args = NULL;
+  return v;
+}
+
+/* Symbol table. Every symbol name is interned exactly once, so symbols
+   can be compared and hashed by pointer rather than by contents. */
+struct {
+  int count;
+  int buckets;
+  char** names;
+} lsyms;
+
+/* An interned name. Symbols point at "name" itself, which is an ordinary
+   string, and find the rest from there. */
+typedef struct lsym {
+  long version;
+  char name[];
+} lsym;
+
+/* Symbols compared against by the interpreter itself. */
+char* lsym_amp;
+char* lsym_if;
+
+/* FNV-1a hash of a symbol name. */
+unsigned long lsym_hash(char* s) {
+  unsigned long h = 2166136261ul;
+  while (*s) {
+    h ^= (unsigned char)*s++;
+    h *= 16777619ul;
+  }
+  return h;
+}
+
+void lsym_insert(char* name) {
+  unsigned long mask = lsyms.buckets - 1;
+  unsigned long b = lsym_hash(name) & mask;
+  while (lsyms.names[b]) { b = (b + 1) & mask; }
+  lsyms.names[b] = name;
+}
+
+/* Return the canonical copy of the symbol name "s". */
+char* lsym_intern(char* s) {
+  if (lsyms.buckets) {
+    unsigned long mask = lsyms.buckets - 1;
+    unsigned long b = lsym_hash(s) & mask;
+    while (lsyms.names[b]) {
+      if (strcmp(lsyms.names[b], s) == 0) { return lsyms.names[b]; }
+      b = (b + 1) & mask;
+    }
+  }
+
+  /* Grow the table so it stays at most half full. */
+  if ((lsyms.count + 1) * 2 > lsyms.buckets) {
+    char** old = lsyms.names;
+    int old_buckets = lsyms.buckets;
+
+    lsyms.buckets = old_buckets ? old_buckets * 2 : 256;
+    lsyms.names = calloc(lsyms.buckets, sizeof(char*));
+    for (int i = 0; i < old_buckets; i++) {
+      if (old[i]) { lsym_insert(old[i]); }
+    }
+    free(old);
+  }
+
+  lsym* sym = malloc(sizeof(lsym) + strlen(s) + 1);
+  sym->version = 0;
+  strcpy(sym->name, s);
+  lsym_insert(sym->name);
+  lsyms.count++;
+  return sym->name;
+}
+
+/* How many times the global binding of the interned name "name" has been
+   rebound or hidden, see lsym_rebind. */
+static inline long lsym_version(char* name) {
+  return ((lsym*)(name - offsetof(lsym, name)))->version;
+}
+
+/* Note that what "name" means globally has changed, so that code which
+   folded it stops trusting what it found, see lcode_guard. */
+void lsym_rebind(char* name) {
+  ((lsym*)(name - offsetof(lsym, name)))->version++;
+  lfold_epoch++;
+}
+
+void lsym_init(void) {
+  lsym_amp = lsym_intern("&");
+  lsym_if = lsym_intern("if");
+}
+
+lval* lval_sym(char* s) {
+  lval* v = lval_new(LVAL_SYM);
+  v->data.sym = lsym_intern(s);
+  v->hint = LSYM_FREE;
+  return v;
+}
+
+lval* lval_err(char* fmt, ...) {
+  lval* v = lval_new(LVAL_ERR);
+
+  va_list va;
+  va_start(va, fmt);
+
+  v->data.err = malloc(512);
+  vsnprintf(v->data.err, 511, fmt, va);
+  v->data.err = realloc(v->data.err, strlen(v->data.err) + 1);
+
+  va_end(va);
+  return v;
+}
+
+lval* lval_str(char* s) {
+  lval* v = lval_new(LVAL_STR);
+  v->data.str = malloc(strlen(s) + 1);
+  strcpy(v->data.str, s);
+  return v;
+}
+
+/* Bignums */
+lbig* lbig_new(int count) {
+  lbig* b = malloc(sizeof(lbig) + sizeof(uint32_t) * count);
+  b->sign = 1;
+  b->count = count;
+  memset(b->limbs, 0, sizeof(uint32_t) * count);
+  return b;
+}
+
+/* Drop leading zero limbs. Zero has none at all, and is positive. */
+lbig* lbig_trim(lbig* b) {
+  while (b->count && !b->limbs[b->count - 1]) { b->count--; }
+  if (!b->count) { b->sign = 1; }
+  return b;
+}
+
+lbig* lbig_from_long(long x) {
+  unsigned long long m = x < 0 ? -(unsigned long long)x : (unsigned long long)x;
+  lbig* b = lbig_new(2);
+  b->sign = x < 0 ? -1 : 1;
+  b->limbs[0] = (uint32_t)m;
+  b->limbs[1] = (uint32_t)(m >> 32);
+  return lbig_trim(b);
+}
+
+/* Make "b" a Number, as a long if it fits. Takes over "b". */
+lval* lval_big(lbig* b) {
+  lbig_trim(b);
+  if (b->count <= 2) {
+    unsigned long long m = 0;
+    if (b->count > 0) { m = b->limbs[0]; }
+    if (b->count > 1) { m |= (unsigned long long)b->limbs[1] << 32; }
+    if (b->sign > 0 && m <= LONG_MAX) {
+      free(b);
+      return lval_num((long)m);
+    }
+    if (b->sign < 0 && m <= (unsigned long long)LONG_MAX + 1) {
+      free(b);
+      return lval_num(m == (unsigned long long)LONG_MAX + 1 ? LONG_MIN : -(long)m);
+    }
+  }
+
+  lval* v = lval_new(LVAL_BIG);
+  v->data.big = b;
+  return v;
+}
+
+/* The Number "v" as a bignum. Unless it already was one, the caller must
+   free it, see lbig_done. */
+lbig* lbig_of(lval* v) {
+  return lval_is_big(v) ? v->data.big : lbig_from_long(lval_long(v));
+}
+
+void lbig_done(lval* v, lbig* b) {
+  if (!lval_is_big(v)) { free(b); }
+}
+
+lbig* lbig_copy(lbig* b) {
+  lbig* x = lbig_new(b->count);
+  x->sign = b->sign;
+  memcpy(x->limbs, b->limbs, sizeof(uint32_t) * b->count);
+  return x;
+}
+
+int lbig_cmp_mag(lbig* a, lbig* b) {
+  if (a->count != b->count) { return a->count < b->count ? -1 : 1; }
+  for (int i = a->count - 1; i >= 0; i--) {
+    if (a->limbs[i] != b->limbs[i]) { return a->limbs[i] < b->limbs[i] ? -1 : 1; }
+  }
+  return 0;
+}
+
+int lbig_cmp(lbig* a, lbig* b) {
+  if (a->sign != b->sign) { return a->sign; }
+  return a->sign * lbig_cmp_mag(a, b);
+}
+
+/* Add "a", of "na" limbs, into the "n" limbs of "r". Returns the carry out
+   of the top. */
+uint32_t lbig_add_into(uint32_t* r, int n, uint32_t* a, int na) {
+  uint64_t carry = 0;
+  int i;
+  for (i = 0; i < na; i++) {
+    uint64_t t = (uint64_t)r[i] + a[i] + carry;
+    r[i] = (uint32_t)t;
+    carry = t >> 32;
+  }
+  for (; carry && i < n; i++) {
+    uint64_t t = (uint64_t)r[i] + carry;
+    r[i] = (uint32_t)t;
+    carry = t >> 32;
+  }
+  return (uint32_t)carry;
+}
+
+/* Subtract "a", of "na" limbs, from the "n" limbs of "r", which must be at
+   least as big. */
+void lbig_sub_into(uint32_t* r, int n, uint32_t* a, int na) {
+  uint64_t borrow = 0;
+  int i;
+  for (i = 0; i < na; i++) {
+    uint64_t t = (uint64_t)r[i] - a[i] - borrow;
+    r[i] = (uint32_t)t;
+    borrow = (t >> 32) ? 1 : 0;
+  }
+  for (; borrow && i < n; i++) {
+    uint64_t t = (uint64_t)r[i] - borrow;
+    r[i] = (uint32_t)t;
+    borrow = (t >> 32) ? 1 : 0;
+  }
+}
+
+/* "a" plus "b" times "sign". */
+lbig* lbig_add(lbig* a, lbig* b, int sign) {
+  int bsign = b->sign * sign;
+  lbig* r;
+  if (a->sign == bsign) {
+    lbig* hi = a->count >= b->count ? a : b;
+    lbig* lo = hi == a ? b : a;
+    r = lbig_new(hi->count + 1);
+    memcpy(r->limbs, hi->limbs, sizeof(uint32_t) * hi->count);
+    lbig_add_into(r->limbs, r->count, lo->limbs, lo->count);
+    r->sign = a->sign;
+  } else {
+    int c = lbig_cmp_mag(a, b);
+    lbig* hi = c >= 0 ? a : b;
+    lbig* lo = hi == a ? b : a;
+    r = lbig_copy(hi);
+    lbig_sub_into(r->limbs, r->count, lo->limbs, lo->count);
+    r->sign = c >= 0 ? a->sign : bsign;
+  }
+  return lbig_trim(r);
+}
+
+/* Multiplying numbers of at least this many limbs splits them, see
+   lbig_mul_into. */
+#define LBIG_KARATSUBA 32
+
+/* Add the product of "a" and "b", of "na" >= "nb" limbs, into "r", which
+   has "na" + "nb" limbs and must start out zero. Long numbers are
+   multiplied by Karatsuba's method: with each split into a high and low
+   half at "h" limbs, a*b = z2*B^2h + z1*B^h + z0, where z2 = a1*b1 and
+   z0 = a0*b0, and z1 = (a0 + a1)(b0 + b1) - z2 - z0 takes one multiply
+   rather than two. */
+void lbig_mul_into(uint32_t* r, uint32_t* a, int na, uint32_t* b, int nb) {
+  if (nb < LBIG_KARATSUBA) {
+    for (int i = 0; i < nb; i++) {
+      uint64_t carry = 0;
+      for (int j = 0; j < na; j++) {
+        uint64_t t = (uint64_t)b[i] * a[j] + r[i + j] + carry;
+        r[i + j] = (uint32_t)t;
+        carry = t >> 32;
+      }
+      r[i + na] = (uint32_t)carry;
+    }
+    return;
+  }
+
+  /* A much longer "a" is done a piece the length of "b" at a time. */
+  if (na >= 2 * nb) {
+    uint32_t* t = malloc(sizeof(uint32_t) * 2 * nb);
+    for (int at = 0; at < na; at += nb) {
+      int n = na - at < nb ? na - at : nb;
+      memset(t, 0, sizeof(uint32_t) * (n + nb));
+      if (n >= nb) { lbig_mul_into(t, a + at, n, b, nb); }
+      else { lbig_mul_into(t, b, nb, a + at, n); }
+      lbig_add_into(r + at, na + nb - at, t, n + nb);
+    }
+    free(t);
+    return;
+  }
+
+  int h = (na + 1) / 2;
+  lbig_mul_into(r, a, h, b, h);
+  lbig_mul_into(r + 2 * h, a + h, na - h, b + h, nb - h);
+
+  /* The high halves are at most h limbs, so both sums fit in h + 1. */
+  uint32_t* sa = calloc(h + 1, sizeof(uint32_t));
+  uint32_t* sb = calloc(h + 1, sizeof(uint32_t));
+  memcpy(sa, a, sizeof(uint32_t) * h);
+  memcpy(sb, b, sizeof(uint32_t) * h);
+  lbig_add_into(sa, h + 1, a + h, na - h);
+  lbig_add_into(sb, h + 1, b + h, nb - h);
+
+  uint32_t* z1 = calloc(2 * h + 2, sizeof(uint32_t));
+  lbig_mul_into(z1, sa, h + 1, sb, h + 1);
+  lbig_sub_into(z1, 2 * h + 2, r, 2 * h);
+  lbig_sub_into(z1, 2 * h + 2, r + 2 * h, na + nb - 2 * h);
+
+  int n = 2 * h + 2;
+  while (n && !z1[n - 1]) { n--; }
+  lbig_add_into(r + h, na + nb - h, z1, n);
+
+  free(sa);
+  free(sb);
+  free(z1);
+}
+
+lbig* lbig_mul(lbig* a, lbig* b) {
+  if (a->count < b->count) {
+    lbig* t = a;
+    a = b;
+    b = t;
+  }
+  lbig* r = lbig_new(a->count + b->count);
+  lbig_mul_into(r->limbs, a->limbs, a->count, b->limbs, b->count);
+  r->sign = a->sign * b->sign;
+  return lbig_trim(r);
+}
+
+/* Divide "u" by "v", which isn't zero, truncating towards zero as C does.
+   The quotient goes in "*q" and the remainder, which takes the sign of "u",
+   in "*r". Either may be NULL if not wanted. */
+void lbig_divmod(lbig* u, lbig* v, lbig** q, lbig** r) {
+  int m = u->count;
+  int n = v->count;
+  lbig* quot;
+  lbig* rem;
+
+  if (lbig_cmp_mag(u, v) < 0) {
+    quot = lbig_new(0);
+    rem = lbig_copy(u);
+  } else if (n == 1) {
+    quot = lbig_new(m);
+    uint64_t d = v->limbs[0];
+    uint64_t t = 0;
+    for (int i = m - 1; i >= 0; i--) {
+      t = (t << 32) | u->limbs[i];
+      quot->limbs[i] = (uint32_t)(t / d);
+      t %= d;
+    }
+    rem = lbig_new(1);
+    rem->limbs[0] = (uint32_t)t;
+  } else {
+    /* Knuth's Algorithm D. Both are first shifted so the top limb of the
+       divisor has its high bit set, which keeps each estimate of a
+       quotient limb at most two too big. */
+    int s = __builtin_clz(v->limbs[n - 1]);
+    uint32_t* vn = malloc(sizeof(uint32_t) * n);
+    uint32_t* un = malloc(sizeof(uint32_t) * (m + 1));
+    for (int i = n - 1; i > 0; i--) {
+      vn[i] = (v->limbs[i] << s) | (s ? v->limbs[i - 1] >> (32 - s) : 0);
+    }
+    vn[0] = v->limbs[0] << s;
+    un[m] = s ? u->limbs[m - 1] >> (32 - s) : 0;
+    for (int i = m - 1; i > 0; i--) {
+      un[i] = (u->limbs[i] << s) | (s ? u->limbs[i - 1] >> (32 - s) : 0);
+    }
+    un[0] = u->limbs[0] << s;
+
+    quot = lbig_new(m - n + 1);
+    for (int j = m - n; j >= 0; j--) {
+      uint64_t top = ((uint64_t)un[j + n] << 32) | un[j + n - 1];
+      uint64_t qhat = top / vn[n - 1];
+      uint64_t rhat = top % vn[n - 1];
+      while (qhat >> 32 ||
+             qhat * vn[n - 2] > ((rhat << 32) | un[j + n - 2])) {
+        qhat--;
+        rhat += vn[n - 1];
+        if (rhat >> 32) { break; }
+      }
+
+      /* Multiply and subtract, adding back if that went below zero. */
+      int64_t k = 0;
+      int64_t t;
+      for (int i = 0; i < n; i++) {
+        uint64_t p = qhat * vn[i];
+        t = (int64_t)un[i + j] - k - (int64_t)(p & 0xffffffff);
+        un[i + j] = (uint32_t)t;
+        k = (int64_t)(p >> 32) - (t >> 32);
+      }
+      t = (int64_t)un[j + n] - k;
+      un[j + n] = (uint32_t)t;
+
+      quot->limbs[j] = (uint32_t)qhat;
+      if (t < 0) {
+        quot->limbs[j]--;
+        uint64_t c = 0;
+        for (int i = 0; i < n; i++) {
+          c += (uint64_t)un[i + j] + vn[i];
+          un[i + j] = (uint32_t)c;
+          c >>= 32;
+        }
+        un[j + n] += (uint32_t)c;
+      }
+    }
+
+    rem = lbig_new(n);
+    for (int i = 0; i < n; i++) {
+      rem->limbs[i] = (un[i] >> s) | (s ? un[i + 1] << (32 - s) : 0);
+    }
+    free(vn);
+    free(un);
+  }
+
+  quot->sign = u->sign * v->sign;
+  rem->sign = u->sign;
+  lbig_trim(quot);
+  lbig_trim(rem);
+  if (q) { *q = quot; } else { free(quot); }
+  if (r) { *r = rem; } else { free(rem); }
+}
+
+/* Multiply "b" by "m" and add "a", in place, growing it if need be. */
+lbig* lbig_muladd(lbig* b, uint32_t m, uint32_t a) {
+  uint64_t carry = a;
+  for (int i = 0; i < b->count; i++) {
+    uint64_t t = (uint64_t)b->limbs[i] * m + carry;
+    b->limbs[i] = (uint32_t)t;
+    carry = t >> 32;
+  }
+  if (carry) {
+    b = realloc(b, sizeof(lbig) + sizeof(uint32_t) * (b->count + 1));
+    b->limbs[b->count++] = (uint32_t)carry;
+  }
+  return b;
+}
+
+/* Read the decimal integer at the start of "s". */
+lbig* lbig_read(char* s) {
+  int sign = 1;
+  if (*s == '-') {
+    sign = -1;
+    s++;
+  }
+
+  lbig* b = lbig_new(0);
+  while (isdigit(*s)) {
+    /* Nine digits at a time, as 10^9 fits in a limb. */
+    uint32_t chunk = 0;
+    uint32_t scale = 1;
+    for (int i = 0; i < 9 && isdigit(*s); i++, s++) {
+      chunk = chunk * 10 + (*s - '0');
+      scale *= 10;
+    }
+    b = lbig_muladd(b, scale, chunk);
+  }
+  b->sign = sign;
+  return lbig_trim(b);
+}
+
+void lbig_print(lbig* b) {
+  /* Peel off nine decimal digits at a time from the bottom. */
+  lbig* x = lbig_copy(b);
+  int n = 0;
+  uint32_t* digits = malloc(sizeof(uint32_t) * (x->count * 10 / 9 + 2));
+  while (x->count) {
+    uint64_t t = 0;
+    for (int i = x->count - 1; i >= 0; i--) {
+      t = (t << 32) | x->limbs[i];
+      x->limbs[i] = (uint32_t)(t / 1000000000);
+      t %= 1000000000;
+    }
+    digits[n++] = (uint32_t)t;
+    lbig_trim(x);
+  }
+
+  if (b->sign < 0) { putchar('-'); }
+  printf("%u", n ? digits[n - 1] : 0);
+  for (int i = n - 2; i >= 0; i--) { printf("%09u", digits[i]); }
+  free(digits);
+  free(x);
+}
+
+/* Any Number as a double, rounding bignums to the nearest. */
+double lnum_double(lval* v) {
+  if (lval_is_dbl(v)) { return v->data.dbl; }
+  if (!lval_is_big(v)) { return (double)lval_long(v); }
+
+  double d = 0;
+  lbig* b = v->data.big;
+  for (int i = b->count - 1; i >= 0; i--) { d = d * 4294967296.0 + b->limbs[i]; }
+  return b->sign * d;
+}
+
+/* Print with as few digits as read back the same, and always with a
+   decimal point or exponent, so that it doesn't look like an integer. */
+void lnum_print_dbl(double x) {
+  char buf[32];
+  for (int digits = 15; digits <= 17; digits++) {
+    snprintf(buf, sizeof(buf), "%.*g", digits, x);
+    if (strtod(buf, NULL) == x) { break; }
+  }
+  if (!strpbrk(buf, ".en")) { strcat(buf, ".0"); }
+  fputs(buf, stdout);
+}
+
+/* Arithmetic on Numbers of any kind, for when longs won't do. These
+   return a new Number, or an error. */
+int lnum_cmp_slow(lval* x, lval* y) {
+  if (lval_is_dbl(x) || lval_is_dbl(y)) {
+    double a = lnum_double(x);
+    double b = lnum_double(y);
+    return (a > b) - (a < b);
+  }
+
+  lbig* a = lbig_of(x);
+  lbig* b = lbig_of(y);
+  int c = lbig_cmp(a, b);
+  lbig_done(x, a);
+  lbig_done(y, b);
+  return c;
+}
+
+static inline int lnum_is_true(lval* v) {
+  if (lval_is_long(v)) { return lval_long(v) != 0; }
+  return lval_is_big(v) || v->data.dbl != 0;
+}
+
+static inline int lnum_cmp(lval* x, lval* y) {
+  if (!lval_is_long(x) || !lval_is_long(y)) { return lnum_cmp_slow(x, y); }
+  long a = lval_long(x);
+  long b = lval_long(y);
+  return (a > b) - (a < b);
+}
+
+lval* lnum_addsub(lval* x, lval* y, int sign) {
+  if (lval_is_dbl(x) || lval_is_dbl(y)) {
+    return lval_dbl(lnum_double(x) + sign * lnum_double(y));
+  }
+
+  lbig* a = lbig_of(x);
+  lbig* b = lbig_of(y);
+  lval* r = lval_big(lbig_add(a, b, sign));
+  lbig_done(x, a);
+  lbig_done(y, b);
+  return r;
+}
+
+lval* lnum_add(lval* x, lval* y) { return lnum_addsub(x, y, 1); }
+lval* lnum_sub(lval* x, lval* y) { return lnum_addsub(x, y, -1); }
+
+lval* lnum_mul(lval* x, lval* y) {
+  if (lval_is_dbl(x) || lval_is_dbl(y)) {
+    return lval_dbl(lnum_double(x) * lnum_double(y));
+  }
+
+  lbig* a = lbig_of(x);
+  lbig* b = lbig_of(y);
+  lval* r = lval_big(lbig_mul(a, b));
+  lbig_done(x, a);
+  lbig_done(y, b);
+  return r;
+}
+
+lval* lnum_divmod(lval* x, lval* y, int mod) {
+  if (lval_is_dbl(x) || lval_is_dbl(y)) {
+    double a = lnum_double(x);
+    double b = lnum_double(y);
+    if (b == 0) { return lval_err("Division by zero!"); }
+    return lval_dbl(mod ? fmod(a, b) : a / b);
+  }
+
+  if (!lval_is_big(y) && lval_long(y) == 0) {
+    return lval_err("Division by zero!");
+  }
+
+  lbig* a = lbig_of(x);
+  lbig* b = lbig_of(y);
+  lbig* r;
+  if (mod) { lbig_divmod(a, b, NULL, &r); }
+  else { lbig_divmod(a, b, &r, NULL); }
+  lbig_done(x, a);
+  lbig_done(y, b);
+  return lval_big(r);
+}
+
+lval* lnum_div(lval* x, lval* y) { return lnum_divmod(x, y, 0); }
+lval* lnum_mod(lval* x, lval* y) { return lnum_divmod(x, y, 1); }
+
+/* Results bigger than this many limbs aren't attempted. */
+#define LBIG_MAX_LIMBS (1 << 24)
+
+lval* lnum_pow(lval* x, lval* y) {
+  if (lval_is_dbl(x) || lval_is_dbl(y)) {
+    return lval_dbl(pow(lnum_double(x), lnum_double(y)));
+  }
+
+  /* Only 0, 1 and -1 can be raised to a negative or huge power. The rest
+     go to zero or too big, as truncating pow would. */
+  int big = lval_is_big(x);
+  long base = big ? 0 : lval_long(x);
+  int negative = lval_is_big(y) ? y->data.big->sign < 0 : lval_long(y) < 0;
+  int odd = lval_is_big(y) ? y->data.big->limbs[0] & 1 : lval_long(y) & 1;
+  if (!big && (base == 1 || base == -1)) {
+    return lval_num(base == -1 && odd ? -1 : 1);
+  }
+  if (!big && base == 0) {
+    return negative ? lval_err("Division by zero!") : lval_num(0);
+  }
+  if (negative) { return lval_num(0); }
+
+  lbig* a = lbig_of(x);
+  long bits = (long)a->count * 32 - __builtin_clz(a->limbs[a->count - 1]);
+  if (lval_is_big(y) ||
+      (lval_long(y) && bits > (long)LBIG_MAX_LIMBS * 32 / lval_long(y))) {
+    lbig_done(x, a);
+    return lval_err("Power is too large!");
+  }
+
+  /* Square and multiply. */
+  long n = lval_long(y);
+  lbig* r = lbig_from_long(1);
+  lbig* sq = lbig_copy(a);
+  lbig_done(x, a);
+  while (n) {
+    if (n & 1) {
+      lbig* t = lbig_mul(r, sq);
+      free(r);
+      r = t;
+    }
+    n >>= 1;
+    if (n) {
+      lbig* t = lbig_mul(sq, sq);
+      free(sq);
+      sq = t;
+    }
+  }
+  free(sq);
+  return lval_big(r);
+}
+
+/* The same on longs, as for __builtin_mul_overflow: true if the result
+   doesn't fit, or for a lnum_* function to work out or report. */
+static inline int ldiv_overflow(long x, long y, long* r) {
+  if (y == 0 || (x == LONG_MIN && y == -1)) { return 1; }
+  *r = x / y;
+  return 0;
+}
+
+static inline int lmod_overflow(long x, long y, long* r) {
+  if (y == 0 || (x == LONG_MIN && y == -1)) { return 1; }
+  *r = x % y;
+  return 0;
+}
+
+static inline int lpow_overflow(long x, long y, long* r) {
+  if (y < 0) { return 1; }
+  long acc = 1;
+  while (y) {
+    if ((y & 1) && __builtin_mul_overflow(acc, x, &acc)) { return 1; }
+    y >>= 1;
+    if (y && __builtin_mul_overflow(x, x, &x)) { return 1; }
+  }
+  *r = acc;
+  return 0;
+}
+
+lval* lval_copy(lval* v);
+
+lcells* lcells_new(int capacity) {
+  lcells* c = malloc(sizeof(lcells) + sizeof(lval*) * capacity);
+  c->count = 0;
+  c->capacity = capacity;
+  c->refs = 1;
+  c->cell = c->items;
+  c->base = NULL;
+  return c;
+}
+
+/* A view of "count" items of "c" from "start", without copying them. */
+lcells* lcells_slice(lcells* c, int start, int count) {
+  lcells* b = c->base ? c->base : c;
+  b->refs++;
+
+  lcells* s = lcells_new(0);
+  s->count = count;
+  s->cell = c->cell + start;
+  s->base = b;
+  return s;
+}
+
+/* A private copy of "c", sharing the lvals but not the block. */
+lcells* lcells_copy(lcells* c) {
+  lcells* x = lcells_new(c->count);
+  x->count = c->count;
+  for (int i = 0; i < c->count; i++) {
+    x->cell[i] = lval_copy(c->cell[i]);
+  }
+  return x;
+}
+
+static inline int lcells_shared(lcells* c) {
+  return c->base || c->refs > 1;
+}
+
+void lval_del(lval* v);
+
+void lcells_release(lcells* c) {
+  lcells* b = c->base ? c->base : c;
+  if (c->base) { free(c); }
+  if (--b->refs > 0) { return; }
+
+  for (int i = 0; i < b->count; i++) {
+    lval_del(b->cell[i]);
+  }
+  free(b);
+}
+
+/* Persistent vectors */
+lvnode* lvnode_new(int height) {
+  lvnode* n = lpool_alloc(&lvnode_pool);
+  n->refs = 1;
+  n->height = height;
+  n->count = 0;
+  n->size = 0;
+  n->tenured = 0;
+#ifdef LISPY_GC
+  n->gc_mark = lgc.epoch;
+#endif
+  return n;
+}
+
+void lvnode_del(lvnode* n) {
+  if (--n->refs > 0) { return; }
+  for (int i = 0; i < n->count; i++) {
+    if (n->height) { lvnode_del(n->kids[i]); }
+    else { lval_del(n->items[i]); }
+  }
+  lpool_free(&lvnode_pool, n);
+}
+
+void lcode_ref(lcode* c) { c->refs++; }
+
+#ifdef LISPY_JIT
+void ljit_del(ljit* j);
+#endif
+
+void lcode_del(lcode* c) {
+  if (--c->refs > 0) { return; }
+#ifdef LISPY_JIT
+  if (c->jit) { ljit_del(c->jit); }
+#endif
+  for (int i = 0; i < c->nconsts; i++) { lval_del(c->consts[i]); }
+  free(c->consts);
+  free(c->ops);
+  free(c->guards);
+  free(c);
+}
+
+/* Add a child to the end of "n", which isn't shared yet, taking the
+   caller's reference to it. */
+void lvnode_adopt(lvnode* n, lvnode* k) {
+  n->kids[n->count++] = k;
+  n->size += k->size;
+}
+
+/* Add entry "i" of "src" to the end of "n", which isn't shared yet. */
+void lvnode_push(lvnode* n, lvnode* src, int i) {
+  if (n->height) {
+    src->kids[i]->refs++;
+    lvnode_adopt(n, src->kids[i]);
+  } else {
+    n->items[n->count++] = lval_copy(src->items[i]);
+    n->size++;
+  }
+}
+
+/* A vector holding the items of "c", or NULL if there are none. */
+lvnode* lvnode_build(lcells* c) {
+  if (c->count == 0) { return NULL; }
+
+  /* Fill leaves, then gather each level into the one above. */
+  int n = (c->count + LVEC_WIDTH - 1) / LVEC_WIDTH;
+  lvnode** level = malloc(sizeof(lvnode*) * n);
+  for (int i = 0; i < n; i++) {
+    lvnode* leaf = lvnode_new(0);
+    for (int j = i * LVEC_WIDTH; j < c->count && leaf->count < LVEC_WIDTH; j++) {
+      leaf->items[leaf->count++] = lval_copy(c->cell[j]);
+    }
+    leaf->size = leaf->count;
+    level[i] = leaf;
+  }
+
+  for (int h = 1; n > 1; h++) {
+    int m = (n + LVEC_WIDTH - 1) / LVEC_WIDTH;
+    for (int i = 0; i < m; i++) {
+      lvnode* node = lvnode_new(h);
+      for (int j = i * LVEC_WIDTH; j < n && node->count < LVEC_WIDTH; j++) {
+        lvnode_adopt(node, level[j]);
+      }
+      level[i] = node;
+    }
+    n = m;
+  }
+
+  lvnode* root = level[0];
+  free(level);
+  return root;
+}
+
+lval* lvnode_get(lvnode* n, int i) {
+  while (n->height) {
+    int k = 0;
+    while (i >= n->kids[k]->size) { i -= n->kids[k]->size; k++; }
+    n = n->kids[k];
+  }
+  return n->items[i];
+}
+
+void lvnode_flatten(lvnode* n, lcells* c) {
+  for (int i = 0; i < n->count; i++) {
+    if (n->height) { lvnode_flatten(n->kids[i], c); }
+    else { c->cell[c->count++] = lval_copy(n->items[i]); }
+  }
+}
+
+/* A plain list of the items under "n". */
+lcells* lvnode_cells(lvnode* n) {
+  lcells* c = lcells_new(n->size);
+  lvnode_flatten(n, c);
+  return c;
+}
+
+/* The items of "n" from "start" up to "end", which mustn't be empty. Nodes
+   wholly inside the range are shared, so only the two edges are copied.
+   The result is as tall as "n", though it may be thin. */
+lvnode* lvnode_slice(lvnode* n, int start, int end) {
+  if (start == 0 && end == n->size) {
+    n->refs++;
+    return n;
+  }
+
+  lvnode* x = lvnode_new(n->height);
+  int offset = 0;
+  for (int i = 0; i < n->count && offset < end; i++) {
+    int size = n->height ? n->kids[i]->size : 1;
+    if (offset + size > start) {
+      if (n->height) {
+        int s = start > offset ? start - offset : 0;
+        int e = end < offset + size ? end - offset : size;
+        lvnode_adopt(x, lvnode_slice(n->kids[i], s, e));
+      } else {
+        lvnode_push(x, n, i);
+      }
+    }
+    offset += size;
+  }
+  return x;
+}
+
+/* Drop roots with a single child, as slicing leaves behind. */
+lvnode* lvnode_shrink(lvnode* n) {
+  while (n->height && n->count == 1) {
+    lvnode* k = n->kids[0];
+    k->refs++;
+    lvnode_del(n);
+    n = k;
+  }
+  return n;
+}
+
+/* A node of height "h" adopting "count" children. */
+lvnode* lvnode_of(int h, lvnode** kids, int count) {
+  lvnode* x = lvnode_new(h);
+  for (int i = 0; i < count; i++) { lvnode_adopt(x, kids[i]); }
+  return x;
+}
+
+/* Join "a" and "b", taking the caller's references to both. The result is
+   as tall as the taller of the two, or a level taller if the nodes along
+   the seam overflow, in which case they are split like a B-tree's. Only
+   nodes along the seam are copied. */
+lvnode* lvnode_concat(lvnode* a, lvnode* b) {
+  if (a->height == b->height) {
+    if (a->count + b->count > LVEC_WIDTH) {
+      lvnode* kids[2] = { a, b };
+      return lvnode_of(a->height + 1, kids, 2);
+    }
+    lvnode* x = lvnode_new(a->height);
+    for (int i = 0; i < a->count; i++) { lvnode_push(x, a, i); }
+    for (int i = 0; i < b->count; i++) { lvnode_push(x, b, i); }
+    lvnode_del(a);
+    lvnode_del(b);
+    return x;
+  }
 
-    /* A function */
-    struct {
-      lbuiltin builtin;
-      lenv* env;
-      lval* formals;
-      lval* body;
-    } fn;
+  /* Join the shorter one onto the near edge of the taller one. */
+  int left = a->height > b->height;
+  lvnode* t = left ? a : b;
+  int h = t->height;
+  lvnode* edge = t->kids[left ? t->count - 1 : 0];
+  edge->refs++;
+  lvnode* r = left ? lvnode_concat(edge, b) : lvnode_concat(a, edge);
+
+  /* Rebuild "t" around the new edge. If that grew a level, its children
+     take its place. */
+  lvnode* kids[2 * LVEC_WIDTH];
+  int n = 0;
+  int rn = r->height < h ? 1 : r->count;
+  if (!left) { n += rn; }
+  for (int i = left ? 0 : 1; i < (left ? t->count - 1 : t->count); i++) {
+    t->kids[i]->refs++;
+    kids[n++] = t->kids[i];
+  }
+  int at = left ? n : 0;
+  if (r->height < h) {
+    kids[at] = r;
+  } else {
+    for (int i = 0; i < r->count; i++) {
+      r->kids[i]->refs++;
+      kids[at + i] = r->kids[i];
+    }
+    lvnode_del(r);
+  }
+  if (left) { n += rn; }
+  lvnode_del(t);
+
+  if (n <= LVEC_WIDTH) { return lvnode_of(h, kids, n); }
+  lvnode* halves[2] = {
+    lvnode_of(h, kids, n / 2),
+    lvnode_of(h, kids + n / 2, n - n / 2)
+  };
+  return lvnode_of(h + 1, halves, 2);
+}
 
-    /* List of more sexprs. */
-    struct {
-      int count;
-      struct lval** cell;
-    } sexprs;
-  } data;
-} lval;
+int lval_len(lval* v) {
+  return v->type == LVAL_VEC ? v->data.vec->size : v->data.sexprs->count;
+}
 
-/* lval constructors and destructor */
-lval* lval_num(long x) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_NUM;
-  v->data.num = x;
-  return v;
+/* Item "i" of a Q-expression, without taking a reference. */
+lval* lval_index(lval* v, int i) {
+  if (v->type == LVAL_VEC) { return lvnode_get(v->data.vec, i); }
+  return v->data.sexprs->cell[i];
 }
 
-lval* lval_fun(lbuiltin func) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_FUN;
-  v->data.fn.builtin = func;
+/* A Q-expression for the vector "n", taking the caller's reference. Short
+   ones are turned back into plain lists. */
+lval* lval_vec(lvnode* n) {
+  if (!n || n->size < LVEC_FLAT) {
+    lval* v = lval_new(LVAL_QEXPR);
+    v->data.sexprs = n ? lvnode_cells(n) : lcells_new(0);
+    if (n) { lvnode_del(n); }
+    return v;
+  }
+  lval* v = lval_new(LVAL_VEC);
+  v->data.vec = n;
   return v;
 }
 
-lenv* lenv_new(void);
-
-lval* lval_lambda(lval* formals, lval* body) {
-  lval* v = malloc(sizeof(lval));
+/* Turn the vector "v" into a plain Q-expression in place. This is fine
+   even if "v" is shared, as its value doesn't change. */
+void lval_flatten(lval* v) {
+  if (LVAL_IS_INT(v) || v->type != LVAL_VEC) { return; }
+  lvnode* n = v->data.vec;
+  v->type = LVAL_QEXPR;
+  v->data.sexprs = lvnode_cells(n);
+  lvnode_del(n);
+}
 
-  v->type = LVAL_FUN;
-  v->data.fn.builtin = NULL;
-  v->data.fn.env = lenv_new();
-  v->data.fn.formals = formals;
-  v->data.fn.body = body;
-  return v;
+/* A reference to the items of the Q-expression "v" as a vector. Long
+   plain lists are converted in place, so that the next time is free. */
+lvnode* lval_vroot(lval* v) {
+  if (v->type == LVAL_QEXPR && v->data.sexprs->count > LVEC_MIN) {
+    lcells* c = v->data.sexprs;
+    v->type = LVAL_VEC;
+    v->data.vec = lvnode_build(c);
+    lcells_release(c);
+  }
+  if (v->type == LVAL_VEC) {
+    v->data.vec->refs++;
+    return v->data.vec;
+  }
+  return lvnode_build(v->data.sexprs);
 }
 
-lval* lval_sym(char* s) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_SYM;
-  v->data.sym = malloc(strlen(s) + 1);
-  strcpy(v->data.sym, s);
-  return v;
+/* Join two Q-expressions into a vector, taking both. */
+lval* lval_vjoin(lval* x, lval* y) {
+  lvnode* a = lval_vroot(x);
+  lvnode* b = lval_vroot(y);
+  lval_del(x);
+  lval_del(y);
+  if (!a) { return lval_vec(b); }
+  if (!b) { return lval_vec(a); }
+  return lval_vec(lvnode_concat(a, b));
 }
 
-lval* lval_err(char* fmt, ...) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_ERR;
+/* The "count" items of the vector "v" from "start", taking "v". */
+lval* lval_vslice(lval* v, int start, int count) {
+  lvnode* n = NULL;
+  if (count > 0) {
+    n = lvnode_shrink(lvnode_slice(v->data.vec, start, start + count));
+  }
+  lval_del(v);
+  return lval_vec(n);
+}
 
-  va_list va;
-  va_start(va, fmt);
+/* Make room for "n" more items at the end of "c". Space freed at the front
+   is reclaimed first, otherwise the capacity is doubled. */
+lcells* lcells_reserve(lcells* c, int n) {
+  int start = c->cell - c->items;
+  if (start + c->count + n <= c->capacity) { return c; }
 
-  v->data.err = malloc(512);
-  vsnprintf(v->data.err, 511, fmt, va);
-  v->data.err = realloc(v->data.err, strlen(v->data.err) + 1);
+  if (c->count + n <= c->capacity / 2) {
+    memmove(c->items, c->cell, sizeof(lval*) * c->count);
+    c->cell = c->items;
+    return c;
+  }
 
-  va_end(va);
-  return v;
-}
+  int capacity = c->capacity ? c->capacity * 2 : 4;
+  while (capacity < c->count + n) { capacity *= 2; }
 
-lval* lval_str(char* s) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_STR;
-  v->data.str = malloc(strlen(s) + 1);
-  strcpy(v->data.str, s);
-  return v;
+  /* Drop the space at the front as well, while moving anyway. */
+  memmove(c->items, c->cell, sizeof(lval*) * c->count);
+  c = realloc(c, sizeof(lcells) + sizeof(lval*) * capacity);
+  c->capacity = capacity;
+  c->cell = c->items;
+  return c;
 }
 
 lval* lval_sexpr(void) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_SEXPR;
-  v->data.sexprs.count = 0;
-  v->data.sexprs.cell = NULL;
+  lval* v = lval_new(LVAL_SEXPR);
+  v->data.sexprs = lcells_new(0);
   return v;
 }
 
 lval* lval_qexpr(void) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_QEXPR;
-  v->data.sexprs.count = 0;
-  v->data.sexprs.cell = NULL;
+  lval* v = lval_new(LVAL_QEXPR);
+  v->data.sexprs = lcells_new(0);
   return v;
 }
 
 lval* lval_add(lval* v, lval* x) {
-  v->data.sexprs.count++;
-  v->data.sexprs.cell = realloc(v->data.sexprs.cell,
-                                sizeof(lval*) * v->data.sexprs.count);
-  v->data.sexprs.cell[v->data.sexprs.count - 1] = x;
+  v->data.sexprs = lcells_reserve(v->data.sexprs, 1);
+  v->data.sexprs->cell[v->data.sexprs->count++] = x;
+  return v;
+}
+
+/* Take another reference to "v". */
+lval* lval_copy(lval* v) {
+  if (LVAL_IS_INT(v)) { return v; }
+  v->refs++;
   return v;
 }
 
 lenv* lenv_copy(lenv*);
 
-lval* lval_copy(lval* v) {
-  lval* x = malloc(sizeof(lval));
-  x->type = v->type;
+/* Return a version of "v" that the caller can mutate in place. If anyone
+   else holds "v" this is a shallow copy, sharing the children, and the
+   caller's reference to the original is released. */
+lval* lval_unshare(lval* v) {
+  if (LVAL_IS_INT(v)) { return v; }
+
+  /* Vectors can't be changed in place, so this gives a plain list. */
+  if (v->type == LVAL_VEC) {
+    if (v->refs == 1) {
+      lval_flatten(v);
+      return v;
+    }
+    lval* x = lval_new(LVAL_QEXPR);
+    x->data.sexprs = lvnode_cells(v->data.vec);
+    lval_del(v);
+    return x;
+  }
+  if (v->refs == 1) {
+    /* Only the lval is private, the items may still be shared. */
+    if ((v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) &&
+        lcells_shared(v->data.sexprs)) {
+      lcells* c = v->data.sexprs;
+      v->data.sexprs = lcells_copy(c);
+      lcells_release(c);
+    }
+    return v;
+  }
 
+  lval* x = lval_new(v->type);
   switch (x->type) {
     case LVAL_FUN:
-      if (v->data.fn.builtin) {
-        x->data.fn.builtin = v->data.fn.builtin;
-      } else {
-        x->data.fn.builtin = NULL;
-        x->data.fn.env = lenv_copy(v->data.fn.env);
-        x->data.fn.formals = lval_copy(v->data.fn.formals);
-        x->data.fn.body = lval_copy(v->data.fn.body);
+      x->data.fn = lpool_alloc(&lfun_pool);
+      x->data.fn->builtin = v->data.fn->builtin;
+      x->data.fn->builtin_argv = v->data.fn->builtin_argv;
+      if (!lfun_is_builtin(v->data.fn)) {
+        lfun* fn = v->data.fn;
+        x->data.fn->env = fn->env ? lenv_copy(fn->env) : NULL;
+        x->data.fn->formals = lval_copy(fn->formals);
+        x->data.fn->body = lval_copy(fn->body);
+        x->data.fn->code = fn->code;
+        if (fn->code) { lcode_ref(fn->code); }
+        x->data.fn->aot = fn->aot;
+        x->data.fn->callee = fn->callee ? lval_copy(fn->callee) : NULL;
+        x->data.fn->args = fn->args ? lval_copy(fn->args) : NULL;
       }
       break;
     case LVAL_NUM: x->data.num = v->data.num; break;
+    case LVAL_BIG: x->data.big = lbig_copy(v->data.big); break;
+    case LVAL_DBL: x->data.dbl = v->data.dbl; break;
 
     case LVAL_ERR:
       x->data.err = malloc(strlen(v->data.err) + 1);
@@ -171,8 +1688,8 @@ lval* lval_copy(lval* v) {
       break;
 
     case LVAL_SYM:
-      x->data.sym = malloc(strlen(v->data.sym) + 1);
-      strcpy(x->data.sym, v->data.sym);
+      x->data.sym = v->data.sym;
+      x->hint = v->hint;
       break;
 
     case LVAL_STR:
@@ -182,66 +1699,96 @@ lval* lval_copy(lval* v) {
 
     case LVAL_QEXPR:
     case LVAL_SEXPR:
-      x->data.sexprs.count = v->data.sexprs.count;
-      x->data.sexprs.cell = malloc(sizeof(lval*) * x->data.sexprs.count);
-      for (int i = 0; i < x->data.sexprs.count; i++) {
-        x->data.sexprs.cell[i] = lval_copy(v->data.sexprs.cell[i]);
-      }
+      x->data.sexprs = lcells_copy(v->data.sexprs);
       break;
   }
 
+  lval_del(v);
   return x;
 }
 
 void lenv_del(lenv*);
 
 void lval_del(lval* v) {
+  if (LVAL_IS_INT(v) || --v->refs > 0) { return; }
+
   switch (v->type) {
     case LVAL_NUM: break;
 
     case LVAL_ERR: free(v->data.err); break;
-    case LVAL_SYM: free(v->data.sym); break;
+    case LVAL_SYM: break;
     case LVAL_STR: free(v->data.str); break;
+    case LVAL_BIG: free(v->data.big); break;
 
     case LVAL_FUN:
-      if (!v->data.fn.builtin) {
-        lenv_del(v->data.fn.env);
-        lval_del(v->data.fn.formals);
-        lval_del(v->data.fn.body);
+      if (!lfun_is_builtin(v->data.fn)) {
+        if (v->data.fn->env) { lenv_del(v->data.fn->env); }
+        lval_del(v->data.fn->formals);
+        lval_del(v->data.fn->body);
+        if (v->data.fn->code) { lcode_del(v->data.fn->code); }
+        if (v->data.fn->callee) {
+          lval_del(v->data.fn->callee);
+          lval_del(v->data.fn->args);
+        }
       }
+      lpool_free(&lfun_pool, v->data.fn);
       break;
 
     case LVAL_QEXPR:
     case LVAL_SEXPR:
-      /* Recursively delete sexprs with this one. */
-      for (int i = 0; i < v->data.sexprs.count; i++) {
-        lval_del(v->data.sexprs.cell[i]);
-      }
-      /* Free pointer list. */
-      free(v->data.sexprs.cell);
+      /* Recursively delete sexprs with this one, unless a slice still
+         needs them. */
+      lcells_release(v->data.sexprs);
       break;
+
+    case LVAL_VEC: lvnode_del(v->data.vec); break;
   }
   /* Free the lval struct itself. */
-  free(v);
+  lval_free(v);
 }
 
 lval* lval_pop(lval* v, int i) {
+  lcells* c = v->data.sexprs;
+
   /* Find the item at "i" */
-  lval* x = v->data.sexprs.cell[i];
+  lval* x = c->cell[i];
 
-  /* Shift memory after the item at "i" over the top. */
-  memmove(&v->data.sexprs.cell[i], &v->data.sexprs.cell[i + 1],
-          sizeof(lval*) * (v->data.sexprs.count - i - 1));
+  if (i == 0) {
+    /* Popping the front just moves the start along. */
+    c->cell++;
+  } else {
+    /* Shift memory after the item at "i" over the top. */
+    memmove(&c->cell[i], &c->cell[i + 1],
+            sizeof(lval*) * (c->count - i - 1));
+  }
 
   /* Decrease count of items in the list. */
-  v->data.sexprs.count--;
-
-  /* Reallocate the memory used. */
-  v->data.sexprs.cell = realloc(v->data.sexprs.cell,
-                                sizeof(lval*) * v->data.sexprs.count);
+  c->count--;
+  if (c->count == 0) { c->cell = c->items; }
   return x;
 }
 
+/* Return the "count" items of "v" from "start" as a Q-expression. If they
+   are shared this is a slice, which is made without copying anything. */
+lval* lval_slice(lval* v, int start, int count) {
+  lcells* s = lcells_slice(v->data.sexprs, start, count);
+  if (v->refs > 1) {
+    lval* x = lval_new(LVAL_QEXPR);
+    lval_del(v);
+    v = x;
+  } else {
+    lcells_release(v->data.sexprs);
+    v->type = LVAL_QEXPR;
+  }
+  v->data.sexprs = s;
+  return v;
+}
+
+/* Whether "v" can't be changed in place without lval_unshare. */
+int lval_shared(lval* v) {
+  return v->refs > 1 || lcells_shared(v->data.sexprs);
+}
+
 lval* lval_take(lval* v, int i) {
   lval* x = lval_pop(v, i);
   lval_del(v);
@@ -249,8 +1796,17 @@ lval* lval_take(lval* v, int i) {
 }
 
 lval* lval_join(lval* x, lval* y) {
+  if (x->type == LVAL_VEC || y->type == LVAL_VEC ||
+      lval_len(x) + lval_len(y) > LVEC_MIN) {
+    return lval_vjoin(x, y);
+  }
+
+  x = lval_unshare(x);
+  y = lval_unshare(y);
+
   /* For each cell in \"y\" add it to \"x\". */
-  while (y->data.sexprs.count) {
+  x->data.sexprs = lcells_reserve(x->data.sexprs, y->data.sexprs->count);
+  while (y->data.sexprs->count) {
     x = lval_add(x, lval_pop(y, 0));
   }
 
@@ -259,26 +1815,27 @@ lval* lval_join(lval* x, lval* y) {
 }
 
 int lval_eq(lval* x, lval* y) {
-  if (x->type != y->type) { return 0; }
-  switch (x->type) {
-    case LVAL_NUM: return x->data.num == y->data.num;
+  if (lval_type(x) != lval_type(y)) { return 0; }
+  switch (lval_type(x)) {
+    case LVAL_NUM: return lnum_cmp(x, y) == 0;
 
     case LVAL_ERR: return strcmp(x->data.err, y->data.err) == 0;
-    case LVAL_SYM: return strcmp(x->data.sym, y->data.sym) == 0;
+    case LVAL_SYM: return x->data.sym == y->data.sym;
     case LVAL_STR: return strcmp(x->data.str, y->data.str) == 0;
 
     case LVAL_FUN:
-      if (x->data.fn.builtin || y->data.fn.builtin) {
-        return x->data.fn.builtin == y->data.fn.builtin;
+      if (lfun_is_builtin(x->data.fn) || lfun_is_builtin(y->data.fn)) {
+        return x->data.fn->builtin == y->data.fn->builtin &&
+          x->data.fn->builtin_argv == y->data.fn->builtin_argv;
       }
-      return lval_eq(x->data.fn.formals, y->data.fn.formals) &&
-        lval_eq(x->data.fn.body, y->data.fn.body);
+      return lval_eq(x->data.fn->formals, y->data.fn->formals) &&
+        lval_eq(x->data.fn->body, y->data.fn->body);
 
     case LVAL_SEXPR:
     case LVAL_QEXPR:
-      if (x->data.sexprs.count != y->data.sexprs.count) { return 0; }
-      for (int i = 0; i < x->data.sexprs.count; i++) {
-        if (!lval_eq(x->data.sexprs.cell[i], y->data.sexprs.cell[i])) {
+      if (lval_len(x) != lval_len(y)) { return 0; }
+      for (int i = 0; i < lval_len(x); i++) {
+        if (!lval_eq(lval_index(x, i), lval_index(y, i))) {
           return 0;
         }
       }
@@ -292,91 +1849,664 @@ int lval_eq(lval* x, lval* y) {
 typedef struct lenv {
   lenv* parent;
   int count;
+  int capacity;
   char** syms;
   lval** vals;
+  /* Whether syms and vals are an lframe's own arrays rather than malloced. */
+  int inline_slots;
+
+  /* Open addressing hash index into syms/vals. Each bucket holds a slot
+     number plus one, so zero marks an empty bucket. Small frames (most
+     lambda calls) skip it and are scanned linearly instead. */
+  int buckets;
+  int* index;
 } lenv;
 
+/* Frames with at most this many symbols are not hashed. */
+#define LENV_SCAN_MAX 4
+
+_Thread_local lpool lenv_pool = { sizeof(lenv) };
+
 lenv* lenv_new(void) {
-  lenv* e = malloc(sizeof(lenv));
+  lenv* e = lpool_alloc(&lenv_pool);
   e->parent = NULL;
   e->count = 0;
+  e->capacity = 0;
   e->syms = NULL;
   e->vals = NULL;
+  e->inline_slots = 0;
+  e->buckets = 0;
+  e->index = NULL;
+  return e;
+}
+
+/* Symbols are interned, so their address is a good enough hash. */
+static inline unsigned long lenv_hash(char* sym) {
+  unsigned long h = (unsigned long)sym;
+  return (h >> 4) ^ (h >> 12);
+}
+
+void lenv_index_insert(lenv* e, int slot) {
+  unsigned long mask = e->buckets - 1;
+  unsigned long b = lenv_hash(e->syms[slot]) & mask;
+  while (e->index[b]) { b = (b + 1) & mask; }
+  e->index[b] = slot + 1;
+}
+
+/* Rebuild the index so it stays at most half full. */
+void lenv_reindex(lenv* e) {
+  int buckets = 16;
+  while (buckets < e->count * 2) { buckets *= 2; }
+
+  free(e->index);
+  e->buckets = buckets;
+  e->index = calloc(buckets, sizeof(int));
+  for (int i = 0; i < e->count; i++) {
+    lenv_index_insert(e, i);
+  }
+}
+
+/* Find the slot holding "sym" in this frame only, or -1. */
+static inline int lenv_find(lenv* e, char* sym) {
+  if (!e->index) {
+    for (int i = 0; i < e->count; i++) {
+      if (e->syms[i] == sym) { return i; }
+    }
+    return -1;
+  }
+
+  unsigned long mask = e->buckets - 1;
+  unsigned long b = lenv_hash(sym) & mask;
+  while (e->index[b]) {
+    int i = e->index[b] - 1;
+    if (e->syms[i] == sym) { return i; }
+    b = (b + 1) & mask;
+  }
+  return -1;
+}
+
+lenv* lenv_copy(lenv* e) {
+  lenv* n = lpool_alloc(&lenv_pool);
+  n->parent = e->parent;
+  n->count = e->count;
+  n->capacity = e->count;
+  n->syms = malloc(sizeof(char*) * n->count);
+  n->vals = malloc(sizeof(lval*) * n->count);
+  n->inline_slots = 0;
+
+  for (int i = 0; i < n->count; i++) {
+    n->syms[i] = e->syms[i];
+    n->vals[i] = lval_copy(e->vals[i]);
+  }
+
+  /* Slots keep their positions, so the index can be copied as is. */
+  n->buckets = e->buckets;
+  n->index = NULL;
+  if (e->index) {
+    n->index = malloc(sizeof(int) * n->buckets);
+    memcpy(n->index, e->index, sizeof(int) * n->buckets);
+  }
+
+  return n;
+}
+
+lval* lenv_get(lenv* e, lval* k) {
+  char* name = k->data.sym;
+  int global = k->hint != LSYM_FREE && (k->hint & LSYM_GLOBAL);
+  int local = k->hint != LSYM_FREE && !global;
+  int slot = k->hint & LSYM_SLOT_MAX;
+
+  for (int d = 0; e; d++, e = e->parent) {
+    /* In the frame the resolver pointed at, try the slot it recorded
+       before falling back to a search. Frames nearer than that are
+       always searched by name, as they may shadow the binding. */
+    int hinted = (local && d == 0) || (global && !e->parent);
+    if (hinted && slot < e->count && e->syms[slot] == name) {
+      return lval_copy(e->vals[slot]);
+    }
+
+    int i = lenv_find(e, name);
+    if (i >= 0) { return lval_copy(e->vals[i]); }
+  }
+  return lval_err("Symbol \"%s\" doesn't exist.", name);
+}
+
+#ifndef LISPY_NO_NURSERY
+lval* lval_tenure(lval* v);
+
+/* Tenure the items under "n". Nodes don't change once built, so a node
+   that has been done once never needs looking at again. */
+void lvnode_tenure(lvnode* n) {
+  if (n->tenured) { return; }
+  for (int i = 0; i < n->count; i++) {
+    if (n->height) { lvnode_tenure(n->kids[i]); }
+    else { n->items[i] = lval_tenure(n->items[i]); }
+  }
+  n->tenured = 1;
+}
+
+void lcode_tenure(lcode* c) {
+  for (int i = 0; i < c->nconsts; i++) {
+    c->consts[i] = lval_tenure(c->consts[i]);
+  }
+}
+#endif
+
+/* Return "v" with it and everything it refers to living in the pool rather
+   than in the nursery. Whatever is young is moved out, or copied if it is
+   shared. Children are replaced in place even in a shared lval, which is
+   safe as the replacements are equal values. */
+lval* lval_tenure(lval* v) {
+#ifndef LISPY_NO_NURSERY
+  if (LVAL_IS_INT(v)) { return v; }
+
+  switch (v->type) {
+    case LVAL_FUN:
+      if (!lfun_is_builtin(v->data.fn)) {
+        lenv* e = v->data.fn->env;
+        for (int i = 0; e && i < e->count; i++) {
+          e->vals[i] = lval_tenure(e->vals[i]);
+        }
+        v->data.fn->formals = lval_tenure(v->data.fn->formals);
+        v->data.fn->body = lval_tenure(v->data.fn->body);
+        if (v->data.fn->code) { lcode_tenure(v->data.fn->code); }
+        if (v->data.fn->callee) {
+          v->data.fn->callee = lval_tenure(v->data.fn->callee);
+          v->data.fn->args = lval_tenure(v->data.fn->args);
+        }
+      }
+      break;
+
+    case LVAL_QEXPR:
+    case LVAL_SEXPR:
+      for (int i = 0; i < v->data.sexprs->count; i++) {
+        v->data.sexprs->cell[i] = lval_tenure(v->data.sexprs->cell[i]);
+      }
+      break;
+
+    case LVAL_VEC: lvnode_tenure(v->data.vec); break;
+  }
+
+  if (!v->young) { return v; }
+
+  lnursery.tenuring = 1;
+  lval* x;
+  if (v->refs > 1 && v->type == LVAL_VEC) {
+    /* Unsharing would flatten it, but the nodes can simply be shared. */
+    x = lval_new(LVAL_VEC);
+    x->data.vec = v->data.vec;
+    x->data.vec->refs++;
+    lval_del(v);
+  } else if (v->refs > 1) {
+    x = lval_unshare(v);
+  } else {
+    x = lval_new(v->type);
+    x->data = v->data;
+    lval_free(v);
+  }
+  lnursery.tenuring = 0;
+  return x;
+#else
+  return v;
+#endif
+}
+
+void lenv_push(lenv* e, char* sym, lval* v);
+
+void lenv_put(lenv* e, lval* k, lval* v) {
+  /* Anything bound globally will be around for a while, so get it out
+     of the nursery. */
+  v = lval_copy(v);
+  if (!e->parent) { v = lval_tenure(v); }
+
+  int i = lenv_find(e, k->data.sym);
+  if (i >= 0) {
+    lval_del(e->vals[i]);
+    e->vals[i] = v;
+    return;
+  }
+
+  lenv_push(e, k->data.sym, v);
+}
+
+/* Add a new binding of "sym" to "v", which "e" takes over, in the next
+   slot of "e". */
+void lenv_push(lenv* e, char* sym, lval* v) {
+  if (e->count == e->capacity) {
+    int capacity = e->capacity ? e->capacity * 2 : 4;
+    if (e->inline_slots) {
+      char** syms = malloc(sizeof(char*) * capacity);
+      lval** vals = malloc(sizeof(lval*) * capacity);
+      memcpy(syms, e->syms, sizeof(char*) * e->count);
+      memcpy(vals, e->vals, sizeof(lval*) * e->count);
+      e->syms = syms;
+      e->vals = vals;
+      e->inline_slots = 0;
+    } else {
+      e->syms = realloc(e->syms, sizeof(char*) * capacity);
+      e->vals = realloc(e->vals, sizeof(lval*) * capacity);
+    }
+    e->capacity = capacity;
+  }
+
+  e->count++;
+  e->vals[e->count - 1] = v;
+  e->syms[e->count - 1] = sym;
+
+  /* Start hashing once the frame outgrows a linear scan. */
+  if (e->count > LENV_SCAN_MAX) {
+    if (e->count * 2 > e->buckets) {
+      lenv_reindex(e);
+    } else {
+      lenv_index_insert(e, e->count - 1);
+    }
+  }
+}
+
+void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
+  lval* k = lval_sym(name);
+  lval* v = lval_fun(func);
+
+  lenv_put(e, k, v);
+
+  lval_del(k);
+  lval_del(v);
+}
+
+void lenv_add_builtin_argv(lenv* e, char* name, lbuiltin_argv func) {
+  lval* k = lval_sym(name);
+  lval* v = lval_fun_argv(func);
+
+  lenv_put(e, k, v);
+
+  lval_del(k);
+  lval_del(v);
+}
+
+void lenv_def(lenv* e, lval* k, lval* v) {
+  while (e->parent) { e = e->parent; }
+  lenv_put(e, k, v);
+}
+
+void lenv_del(lenv* e) {
+  for (int i = 0; i < e->count; i++) {
+    lval_del(e->vals[i]);
+  }
+
+  free(e->syms);
+  free(e->vals);
+  free(e->index);
+  lpool_free(&lenv_pool, e);
+}
+
+/* Activation records.
+
+   A call binds its arguments into a frame of its own rather than into the
+   lambda, which may be shared and never changes. The frame holds what the
+   lambda captured, in the same slots, then the formals in order, which is
+   where lval_resolve expects to find them. It lives on the C stack of
+   whatever runs the call, and small ones keep their bindings inline, so a
+   call allocates nothing for them. */
+#define LFRAME_SLOTS 4
+
+typedef struct lframe {
+  lenv env;
+  char* syms[LFRAME_SLOTS];
+  lval* vals[LFRAME_SLOTS];
+} lframe;
+
+/* Start "a" as the frame of a call made from "e" to the lambda "f", with
+   "args", which lval_apply_tail has already checked fit its formals. */
+void lframe_bind(lframe* a, lenv* e, lval* f, lval* args) {
+  lenv* env = &a->env;
+  lenv* captured = f->data.fn->env;
+  env->parent = lopts.dynamic_scope ? e : captured->parent;
+  env->count = 0;
+  env->capacity = LFRAME_SLOTS;
+  env->syms = a->syms;
+  env->vals = a->vals;
+  env->inline_slots = 1;
+  env->buckets = 0;
+  env->index = NULL;
+
+  for (int i = 0; i < captured->count; i++) {
+    lenv_push(env, captured->syms[i], lval_copy(captured->vals[i]));
+  }
+
+  lval* formals = f->data.fn->formals;
+  for (int i = 0; i < formals->data.sexprs->count; i++) {
+    lval* sym = formals->data.sexprs->cell[i];
+
+    /* The symbol after "&" is bound to the rest of the arguments. */
+    if (sym->data.sym == lsym_amp) {
+      int rest = args->data.sexprs->count - i;
+      lval* val = lval_slice(lval_copy(args), i, rest);
+      lenv_put(env, formals->data.sexprs->cell[i + 1], val);
+      lval_del(val);
+      break;
+    }
+
+    lenv_put(env, sym, args->data.sexprs->cell[i]);
+  }
+  lval_del(args);
+}
+
+void lframe_done(lframe* a) {
+  lenv* e = &a->env;
+  for (int i = 0; i < e->count; i++) {
+    lval_del(e->vals[i]);
+  }
+
+  if (!e->inline_slots) {
+    free(e->syms);
+    free(e->vals);
+  }
+  free(e->index);
+}
+
+/* Move the frame "a" to the heap, for when it has to outlive the call. */
+lenv* lframe_spill(lframe* a) {
+  lenv* e = lpool_alloc(&lenv_pool);
+  *e = a->env;
+  if (e->inline_slots) {
+    e->syms = malloc(sizeof(char*) * e->capacity);
+    e->vals = malloc(sizeof(lval*) * e->capacity);
+    memcpy(e->syms, a->syms, sizeof(char*) * e->count);
+    memcpy(e->vals, a->vals, sizeof(lval*) * e->count);
+    e->inline_slots = 0;
+  }
   return e;
 }
 
-lenv* lenv_copy(lenv* e) {
-  lenv* n = malloc(sizeof(lenv));
-  n->parent = e->parent;
-  n->count = e->count;
-  n->syms = malloc(sizeof(char*) * n->count);
-  n->vals = malloc(sizeof(lval*) * n->count);
+/* The frame of a loop making tail calls, see lval_apply_tail. Each call it
+   makes is entered in place of the one before. */
+typedef struct ltail {
+  lframe frame;
+  /* The lambda running in "frame", or NULL before the first call. */
+  lval* f;
+} ltail;
+
+/* Enter the tail call made from "e" to the lambda "f" with "args". Returns
+   the frame to carry on in. */
+lenv* ltail_enter(ltail* t, lenv* e, lval* f, lval* args) {
+  if (!t->f) {
+    lframe_bind(&t->frame, e, f, args);
+    t->f = f;
+    return &t->frame.env;
+  }
+
+  if (!lopts.dynamic_scope) {
+    lframe_done(&t->frame);
+    lval_del(t->f);
+    lframe_bind(&t->frame, e, f, args);
+    t->f = f;
+    return &t->frame.env;
+  }
+
+  /* With dynamic scope the callee sees the frame the call was made from.
+     Rather than keeping it as the new frame's parent, which would make a
+     loop's frames a chain as long as the loop, what the new frame doesn't
+     shadow is copied into it. The frame only grows to the number of names
+     the loop binds. */
+  lenv* old = lframe_spill(&t->frame);
+  lval_del(t->f);
+  lframe_bind(&t->frame, old->parent, f, args);
+  t->f = f;
+
+  lenv* env = &t->frame.env;
+  for (int i = 0; i < old->count; i++) {
+    if (lenv_find(env, old->syms[i]) < 0) {
+      lenv_push(env, old->syms[i], lval_copy(old->vals[i]));
+    }
+  }
+  lenv_del(old);
+  return env;
+}
+
+void ltail_leave(ltail* t) {
+  if (!t->f) { return; }
+  lframe_done(&t->frame);
+  lval_del(t->f);
+}
+
+#ifdef LISPY_GC
+/* Garbage collection.
+
+   Reference counting frees almost everything as soon as it is dropped. The
+   tracing collector is a backstop behind it: it finds every lval that can
+   no longer be reached, which reference counting would miss if a value
+   ever ended up referring to itself or an error path forgot to drop a
+   reference. It only runs at the REPL's safe point between top level
+   forms, where the evaluation stack is empty and no temporaries are alive,
+   so the global environment is the only root. */
+void lenv_mark(lenv* e);
+
+void lval_mark(lval* v);
+
+void lvnode_mark(lvnode* n) {
+  if (n->gc_mark == lgc.epoch) { return; }
+  n->gc_mark = lgc.epoch;
+  lgc.live_bytes += sizeof(lvnode);
+  for (int i = 0; i < n->count; i++) {
+    if (n->height) { lvnode_mark(n->kids[i]); }
+    else { lval_mark(n->items[i]); }
+  }
+}
+
+void lcode_mark(lcode* c) {
+  if (c->gc_mark == lgc.epoch) { return; }
+  c->gc_mark = lgc.epoch;
+  lgc.live_bytes += sizeof(lcode) + sizeof(int) * c->count +
+    sizeof(lval*) * c->nconsts;
+  for (int i = 0; i < c->nconsts; i++) { lval_mark(c->consts[i]); }
+}
+
+void lval_mark(lval* v) {
+  if (LVAL_IS_INT(v) || v->gc_mark == lgc.epoch) { return; }
+  v->gc_mark = lgc.epoch;
+  lgc.live_bytes += sizeof(lval);
+
+  switch (v->type) {
+    case LVAL_ERR: lgc.live_bytes += strlen(v->data.err) + 1; break;
+    case LVAL_STR: lgc.live_bytes += strlen(v->data.str) + 1; break;
+    case LVAL_BIG:
+      lgc.live_bytes += sizeof(lbig) + sizeof(uint32_t) * v->data.big->count;
+      break;
+
+    case LVAL_FUN:
+      if (!lfun_is_builtin(v->data.fn)) {
+        /* The parent isn't followed: it is either the global frame, or
+           with dynamic scope a caller's frame that is long gone. */
+        if (v->data.fn->env) { lenv_mark(v->data.fn->env); }
+        lval_mark(v->data.fn->formals);
+        lval_mark(v->data.fn->body);
+        if (v->data.fn->code) { lcode_mark(v->data.fn->code); }
+        if (v->data.fn->callee) {
+          lval_mark(v->data.fn->callee);
+          lval_mark(v->data.fn->args);
+        }
+      }
+      break;
+
+    case LVAL_QEXPR:
+    case LVAL_SEXPR: {
+      /* A slice keeps all of its base's items alive, not just its own. */
+      lcells* b = v->data.sexprs->base ? v->data.sexprs->base : v->data.sexprs;
+      lgc.live_bytes += sizeof(lval*) * v->data.sexprs->count;
+      for (int i = 0; i < b->count; i++) {
+        lval_mark(b->cell[i]);
+      }
+      break;
+    }
+
+    case LVAL_VEC: lvnode_mark(v->data.vec); break;
+  }
+}
+
+void lenv_mark(lenv* e) {
+  lgc.live_bytes += sizeof(lenv) + sizeof(int) * e->buckets +
+    (sizeof(char*) + sizeof(lval*)) * e->count;
+  for (int i = 0; i < e->count; i++) {
+    lval_mark(e->vals[i]);
+  }
+}
+
+/* Drop a reference held by an unreachable lval, unless the target is
+   unreachable too and is about to be freed anyway. */
+void lgc_release(lval* v) {
+  if (!LVAL_IS_INT(v) && v->gc_mark == lgc.epoch) { v->refs--; }
+}
 
+/* Drop a reference to a vector node, and if it was the last one, the
+   references the node holds. The node is freed after the sweep. */
+void lgc_release_node(lvnode* n) {
+  if (--n->refs > 0) { return; }
   for (int i = 0; i < n->count; i++) {
-    n->syms[i] = malloc(strlen(e->syms[i]) + 1);
-    strcpy(n->syms[i], e->syms[i]);
-    n->vals[i] = lval_copy(e->vals[i]);
+    if (n->height) { lgc_release_node(n->kids[i]); }
+    else { lgc_release(n->items[i]); }
   }
+  n->gc_next = lgc.doomed_nodes;
+  lgc.doomed_nodes = n;
+}
 
-  return n;
+void lgc_release_code(lcode* c) {
+  if (--c->refs > 0) { return; }
+  for (int i = 0; i < c->nconsts; i++) { lgc_release(c->consts[i]); }
+  c->gc_next = lgc.doomed_code;
+  lgc.doomed_code = c;
 }
 
-lval* lenv_get(lenv* e, lval* k) {
-  for (int i = 0; i < e->count; i++) {
-    if (strcmp(e->syms[i], k->data.sym) == 0) {
-      return lval_copy(e->vals[i]);
+/* Drop every reference held by the unreachable lval "v". */
+void lgc_release_all(lval* v) {
+  switch (v->type) {
+    case LVAL_FUN:
+      if (!lfun_is_builtin(v->data.fn)) {
+        lenv* e = v->data.fn->env;
+        for (int i = 0; e && i < e->count; i++) { lgc_release(e->vals[i]); }
+        lgc_release(v->data.fn->formals);
+        lgc_release(v->data.fn->body);
+        if (v->data.fn->code) { lgc_release_code(v->data.fn->code); }
+        if (v->data.fn->callee) {
+          lgc_release(v->data.fn->callee);
+          lgc_release(v->data.fn->args);
+        }
+      }
+      break;
+
+    case LVAL_QEXPR:
+    case LVAL_SEXPR: {
+      /* Items are held by the base block, on behalf of every lval that
+         uses it. The block can't be freed yet, as other dead lvals may
+         still look at it. */
+      lcells* b = v->data.sexprs->base ? v->data.sexprs->base : v->data.sexprs;
+      if (--b->refs > 0) { break; }
+      for (int i = 0; i < b->count; i++) {
+        lgc_release(b->cell[i]);
+      }
+      b->gc_next = lgc.doomed;
+      lgc.doomed = b;
+      break;
     }
-  }
-  if (e->parent) {
-    return lenv_get(e->parent, k);
-  } else {
-    return lval_err("Symbol \"%s\" doesn't exist.", k->data.sym);
+
+    case LVAL_VEC: lgc_release_node(v->data.vec); break;
   }
 }
 
-void lenv_put(lenv* e, lval* k, lval* v) {
-  for (int i = 0; i < e->count; i++) {
-    if (strcmp(e->syms[i], k->data.sym) == 0) {
-      lval_del(e->vals[i]);
-      e->vals[i] = lval_copy(v);
-      return;
-    }
-  }
+/* Free an unreachable lval and its contents, but not the lvals it refers
+   to, which are swept (or kept) on their own. */
+void lgc_free(lval* v) {
+  switch (v->type) {
+    case LVAL_ERR: free(v->data.err); break;
+    case LVAL_STR: free(v->data.str); break;
+    case LVAL_BIG: free(v->data.big); break;
 
-  e->count++;
-  e->vals = realloc(e->vals, sizeof(lval*) * e->count);
-  e->syms = realloc(e->syms, sizeof(char*) * e->count);
+    case LVAL_FUN:
+      if (!lfun_is_builtin(v->data.fn) && v->data.fn->env) {
+        free(v->data.fn->env->syms);
+        free(v->data.fn->env->vals);
+        free(v->data.fn->env->index);
+        lpool_free(&lenv_pool, v->data.fn->env);
+      }
+      lpool_free(&lfun_pool, v->data.fn);
+      break;
 
-  e->vals[e->count - 1] = lval_copy(v);
-  e->syms[e->count - 1] = malloc(strlen(k->data.sym) + 1);
-  strcpy(e->syms[e->count - 1], k->data.sym);
+    case LVAL_QEXPR:
+    case LVAL_SEXPR:
+      /* Blocks with items are freed once the sweep is done. */
+      if (v->data.sexprs->base) { free(v->data.sexprs); }
+      break;
+  }
+  lval_dealloc(v);
 }
 
-void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
-  lval* k = lval_sym(name);
-  lval* v = lval_fun(func);
+void lgc_collect(lenv* root) {
+  clock_t start = clock();
+
+  lgc.epoch++;
+  lgc.live_bytes = 0;
+  lenv_mark(root);
+
+  /* Unlink everything that wasn't reached. */
+  lval* dead = NULL;
+  lval* v = lgc.heap;
+  while (v) {
+    lval* next = v->gc_next;
+    if (v->gc_mark != lgc.epoch) {
+      if (v->gc_prev) { v->gc_prev->gc_next = next; }
+      else { lgc.heap = next; }
+      if (next) { next->gc_prev = v->gc_prev; }
+      v->gc_next = dead;
+      dead = v;
+      lgc.objects--;
+      lgc.freed++;
+    }
+    v = next;
+  }
 
-  lenv_put(e, k, v);
+  /* Release references into the live heap before freeing anything, as
+     that looks at lvals that may be on the dead list too. */
+  for (v = dead; v; v = v->gc_next) { lgc_release_all(v); }
+  while (dead) {
+    lval* next = dead->gc_next;
+    lgc_free(dead);
+    dead = next;
+  }
+  while (lgc.doomed) {
+    lcells* next = lgc.doomed->gc_next;
+    free(lgc.doomed);
+    lgc.doomed = next;
+  }
+  while (lgc.doomed_nodes) {
+    lvnode* next = lgc.doomed_nodes->gc_next;
+    lpool_free(&lvnode_pool, lgc.doomed_nodes);
+    lgc.doomed_nodes = next;
+  }
+  while (lgc.doomed_code) {
+    lcode* next = lgc.doomed_code->gc_next;
+#ifdef LISPY_JIT
+    if (lgc.doomed_code->jit) { ljit_del(lgc.doomed_code->jit); }
+#endif
+    free(lgc.doomed_code->consts);
+    free(lgc.doomed_code->ops);
+    free(lgc.doomed_code);
+    lgc.doomed_code = next;
+  }
 
-  lval_del(k);
-  lval_del(v);
-}
+  double pause = (double)(clock() - start) / CLOCKS_PER_SEC;
+  lgc.collections++;
+  lgc.pause_total += pause;
+  if (pause > lgc.pause_max) { lgc.pause_max = pause; }
 
-void lenv_def(lenv* e, lval* k, lval* v) {
-  while (e->parent) { e = e->parent; }
-  lenv_put(e, k, v);
+  /* Collect again once the heap has grown by as much as survived. */
+  lgc.allocated = 0;
+  lgc.threshold = lgc.objects > (1 << 16) ? lgc.objects : (1 << 16);
 }
 
-void lenv_del(lenv* e) {
-  for (int i = 0; i < e->count; i++) {
-    free(e->syms[i]);
-    lval_del(e->vals[i]);
-  }
-
-  free(e->syms);
-  free(e->vals);
-  free(e);
+/* Called at the REPL's safe point between top level forms. */
+void lgc_maybe_collect(lenv* root) {
+  if (lgc.allocated >= lgc.threshold) { lgc_collect(root); }
 }
+#endif
 
 
 /* Output */
@@ -392,11 +2522,29 @@ void lval_str_print(lval* v) {
   free(escaped);
 }
 
+void lval_vec_print(lvnode* n, int* first) {
+  for (int i = 0; i < n->count; i++) {
+    if (n->height) {
+      lval_vec_print(n->kids[i], first);
+    } else {
+      if (!*first) { putchar(' '); }
+      *first = 0;
+      lval_print(n->items[i]);
+    }
+  }
+}
+
 void lval_expr_print(lval* v, char open, char close) {
   putchar(open);
-  for (int i = 0; i < v->data.sexprs.count; i++) {
-    lval_print(v->data.sexprs.cell[i]);
-    if (i != (v->data.sexprs.count - 1)) {
+  if (v->type == LVAL_VEC) {
+    int first = 1;
+    lval_vec_print(v->data.vec, &first);
+    putchar(close);
+    return;
+  }
+  for (int i = 0; i < v->data.sexprs->count; i++) {
+    lval_print(v->data.sexprs->cell[i]);
+    if (i != (v->data.sexprs->count - 1)) {
       putchar(' ');
     }
   }
@@ -404,15 +2552,19 @@ void lval_expr_print(lval* v, char open, char close) {
 }
 
 void lval_print(lval* v) {
-  switch (v->type) {
-    case LVAL_NUM: printf("%li", v->data.num); break;
+  switch (lval_type(v)) {
+    case LVAL_NUM:
+      if (lval_is_big(v)) { lbig_print(v->data.big); }
+      else if (lval_is_dbl(v)) { lnum_print_dbl(v->data.dbl); }
+      else { printf("%li", lval_long(v)); }
+      break;
 
     case LVAL_FUN:
-      if (v->data.fn.builtin) {
+      if (lfun_is_builtin(v->data.fn)) {
         printf("<builtin>");
       } else {
-        printf("(\\ "); lval_print(v->data.fn.formals);
-        putchar(' '); lval_print(v->data.fn.body); putchar(')');
+        printf("(\\ "); lval_print(v->data.fn->formals);
+        putchar(' '); lval_print(v->data.fn->body); putchar(')');
       }
       break;
 
@@ -428,10 +2580,11 @@ void lval_println(lval* v) { lval_print(v); putchar('\n'); }
 
 
 lval* lval_read_num(mpc_ast_t* t) {
+  if (strchr(t->contents, '.')) { return lval_dbl(strtod(t->contents, NULL)); }
+
   errno = 0;
   long x = strtol(t->contents, NULL, 10);
-  return errno != ERANGE ?
-    lval_num(x) : lval_err("Invalid number.");
+  return errno != ERANGE ? lval_num(x) : lval_big(lbig_read(t->contents));
 }
 
 lval* lval_read_str(mpc_ast_t* t) {
@@ -466,6 +2619,7 @@ lval* lval_read(mpc_ast_t* t) {
     if (strcmp(t->children[i]->contents, "{") == 0) { continue; }
     if (strcmp(t->children[i]->contents, "}") == 0) { continue; }
     if (strcmp(t->children[i]->tag, "regex") == 0)  { continue; }
+    if (strstr(t->children[i]->tag, "comment"))     { continue; }
     x = lval_add(x, lval_read(t->children[i]));
   }
   return x;
@@ -488,23 +2642,39 @@ char* ltype_name(int t) {
 lval* builtin_var(lenv* e, lval* a, char* func) {
   LASSERT_ARG_TYPE(a, 0, LVAL_QEXPR, "def");
 
-  lval* syms = a->data.sexprs.cell[0];
-  for (int i = 0; i < syms->data.sexprs.count; i++) {
-    LASSERT(a, syms->data.sexprs.cell[i]->type == LVAL_SYM,
+  lval* syms = a->data.sexprs->cell[0];
+  lval_flatten(syms);
+  for (int i = 0; i < syms->data.sexprs->count; i++) {
+    LASSERT(a, lval_type(syms->data.sexprs->cell[i]) == LVAL_SYM,
             "Function \"%s\" cannot define non symbol.", func);
   }
 
-  LASSERT(a, syms->data.sexprs.count == a->data.sexprs.count - 1,
+  LASSERT(a, syms->data.sexprs->count == a->data.sexprs->count - 1,
           "Function \"%s\"'s lists of symbols and values lengths "
           "were different. %i symbols and %i values were passed.",
-          func, syms->data.sexprs.count, a->data.sexprs.count - 1);
+          func, syms->data.sexprs->count, a->data.sexprs->count - 1);
+
+  lenv* global = e;
+  while (global->parent) { global = global->parent; }
+
+  for (int i = 0; i < syms->data.sexprs->count; i++) {
+    char* name = syms->data.sexprs->cell[i]->data.sym;
+    /* "def", or "=" of a name this frame doesn't have yet, changes what
+       the name means globally if it is bound there, by rebinding it or
+       hiding it behind a local. Otherwise "=" only does so at the top. */
+    int rebinds;
+    if (strcmp(func, "def") == 0 || lenv_find(e, name) < 0) {
+      rebinds = lenv_find(global, name) >= 0;
+    } else {
+      rebinds = !e->parent;
+    }
+    if (rebinds) { lsym_rebind(name); }
 
-  for (int i = 0; i < syms->data.sexprs.count; i++) {
     if (strcmp(func, "def") == 0) {
-      lenv_def(e, syms->data.sexprs.cell[i], a->data.sexprs.cell[i + 1]);
+      lenv_def(e, syms->data.sexprs->cell[i], a->data.sexprs->cell[i + 1]);
     }
     if (strcmp(func, "=") == 0) {
-      lenv_put(e, syms->data.sexprs.cell[i], a->data.sexprs.cell[i + 1]);
+      lenv_put(e, syms->data.sexprs->cell[i], a->data.sexprs->cell[i + 1]);
     }
   }
 
@@ -517,31 +2687,848 @@ lval* builtin_put(lenv* e, lval* a) { return builtin_var(e, a, "="); }
 
 lval* lval_eval(lenv* e, lval* v);
 
-lval* builtin_if(lenv* e, lval* a) {
+/* The branch of "if" to evaluate next, as an S-expression. */
+lval* lval_if_branch(lval* a) {
   LASSERT_ARG_COUNT(a, 3, "if");
   LASSERT_ARG_TYPE(a, 0, LVAL_NUM, "if");
   LASSERT_ARG_TYPE(a, 1, LVAL_QEXPR, "if");
   LASSERT_ARG_TYPE(a, 2, LVAL_QEXPR, "if");
 
   lval* exp;
-  if (a->data.sexprs.cell[0]->data.num) {
+  if (lnum_is_true(a->data.sexprs->cell[0])) {
     exp = lval_pop(a, 1);
   } else {
     exp = lval_pop(a, 2);
   }
 
   lval_del(a);
+  exp = lval_unshare(exp);
   exp->type = LVAL_SEXPR;
+  return exp;
+}
+
+lval* builtin_if(lenv* e, lval* a) {
+  lval* exp = lval_if_branch(a);
+  if (lval_type(exp) == LVAL_ERR) { return exp; }
   return lval_eval(e, exp);
 }
 
+/* Resolve the symbols in "v" to frame/slot coordinates, as seen from code
+   running in "frame" once "formals" have been bound into it. At the top
+   level both are NULL. Formals are bound in order after whatever the frame
+   already holds, so everything local sits at depth 0 in a known slot.
+   Anything already in the global frame is addressed there. These are only
+   hints: lenv_get checks them and falls back to a search by name when they
+   don't hold. */
+void lval_resolve(lenv* e, lenv* frame, lval* formals, lval* v) {
+  switch (lval_type(v)) {
+    case LVAL_SYM:
+      v->hint = LSYM_FREE;
+
+      if (frame) {
+        int slot = lenv_find(frame, v->data.sym);
+        if (slot >= 0) {
+          if (slot <= LSYM_SLOT_MAX) { v->hint = slot; }
+          return;
+        }
+      }
+
+      if (formals) {
+        int slot = frame ? frame->count : 0;
+        for (int i = 0; i < formals->data.sexprs->count; i++) {
+          char* name = formals->data.sexprs->cell[i]->data.sym;
+          if (name == lsym_amp) { continue; }
+          if (name == v->data.sym) {
+            if (slot <= LSYM_SLOT_MAX) { v->hint = slot; }
+            return;
+          }
+          slot++;
+        }
+      }
+
+      while (e->parent) { e = e->parent; }
+      int slot = lenv_find(e, v->data.sym);
+      if (slot >= 0 && slot <= LSYM_SLOT_MAX) {
+        v->hint = LSYM_GLOBAL | slot;
+      }
+      break;
+
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      for (int i = 0; i < lval_len(v); i++) {
+        lval_resolve(e, frame, formals, lval_index(v, i));
+      }
+      break;
+  }
+}
+
+/* Copy into the lambda "f" the value of every symbol in "v" that is bound
+   in a local frame of "e", where the lambda is being created. Together with
+   linking the lambda's frame to the global one, this gives lexical scope
+   while keeping closures independent of frames that are about to go. */
+void lval_capture(lenv* e, lval* f, lval* v) {
+  switch (lval_type(v)) {
+    case LVAL_SYM: {
+      char* name = v->data.sym;
+      if (lenv_find(f->data.fn->env, name) >= 0) { return; }
+
+      lval* formals = f->data.fn->formals;
+      for (int i = 0; i < formals->data.sexprs->count; i++) {
+        if (formals->data.sexprs->cell[i]->data.sym == name) { return; }
+      }
+
+      for (; e->parent; e = e->parent) {
+        int i = lenv_find(e, name);
+        if (i >= 0) {
+          lenv_put(f->data.fn->env, v, e->vals[i]);
+          return;
+        }
+      }
+      break;
+    }
+
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      for (int i = 0; i < lval_len(v); i++) {
+        lval_capture(e, f, lval_index(v, i));
+      }
+      break;
+  }
+}
+
+/* Constant folding.
+
+   When a lambda is made, whatever in its body can already be worked out
+   is. A name bound globally stands for its value, a call to a builtin
+   taking "argv", which has no side effects, for its result if the
+   arguments can be worked out too, and an "if" whose condition can for
+   the branch it takes. Names the lambda binds or captured are left alone,
+   and so is anything that would come to an error, to be raised when it
+   runs. None of this changes what the lambda does as long as the globals
+   it relied on are still bound as they were, which LOP_FOLD checks, and
+   once one isn't the lambda is compiled again, see lfun_refresh. */
+typedef struct lfold {
+  lenv* global;
+  /* The lambda being made. */
+  lval* f;
+  /* The code being compiled, given the names folding relies on, or NULL. */
+  struct lcode* code;
+} lfold;
+
+/* Note that "c" relies on what "sym" is bound to globally now. */
+void lcode_guard(lcode* c, char* sym) {
+  for (int i = 0; i < c->nguards; i++) {
+    if (c->guards[i].sym == sym) { return; }
+  }
+  c->guards = realloc(c->guards, sizeof(*c->guards) * (c->nguards + 1));
+  c->guards[c->nguards].sym = sym;
+  c->guards[c->nguards].version = lsym_version(sym);
+  c->nguards++;
+}
+
+/* Whether "sym" is bound in the frame of a call to the lambda. */
+int lfold_is_local(lfold* fold, char* sym) {
+  if (lenv_find(fold->f->data.fn->env, sym) >= 0) { return 1; }
+  lval* formals = fold->f->data.fn->formals;
+  for (int i = 0; i < lval_len(formals); i++) {
+    if (lval_index(formals, i)->data.sym == sym) { return 1; }
+  }
+  return 0;
+}
+
+/* Whether a value can stand in the code for what came to it. A lambda is
+   still looked up, as code holding one could end up holding itself. */
+int lfold_usable(lval* x) {
+  int t = lval_type(x);
+  if (t == LVAL_FUN) { return lfun_is_builtin(x->data.fn); }
+  return t != LVAL_ERR && t != LVAL_SYM && t != LVAL_SEXPR;
+}
+
+lval* lfold_items(lfold* fold, lval* v);
+
+/* The value the name or S-expression "x" comes to, or NULL if that can't
+   be known until it runs. */
+lval* lfold_value(lfold* fold, lval* x) {
+  switch (lval_type(x)) {
+    case LVAL_SYM: {
+      if (lfold_is_local(fold, x->data.sym)) { return NULL; }
+      int i = lenv_find(fold->global, x->data.sym);
+      if (i < 0 || !lfold_usable(fold->global->vals[i])) { return NULL; }
+      if (fold->code) { lcode_guard(fold->code, x->data.sym); }
+      return lval_copy(fold->global->vals[i]);
+    }
+
+    case LVAL_SEXPR: return lfold_items(fold, x);
+  }
+  return NULL;
+}
+
+/* The same for an argument, which may be a literal. */
+lval* lfold_arg(lfold* fold, lval* x) {
+  int t = lval_type(x);
+  if (t == LVAL_SYM || t == LVAL_SEXPR) { return lfold_value(fold, x); }
+  return lval_copy(x);
+}
+
+/* If the items of "v" are an "if" with its branches written out, whose
+   condition can be worked out, the branch it takes. */
+lval* lfold_branch(lfold* fold, lval* v) {
+  if (lval_len(v) != 4 || lval_type(lval_index(v, 2)) != LVAL_QEXPR ||
+      lval_type(lval_index(v, 3)) != LVAL_QEXPR) {
+    return NULL;
+  }
+
+  lval* f = lfold_value(fold, lval_index(v, 0));
+  if (!f) { return NULL; }
+  int is_if = lval_type(f) == LVAL_FUN && f->data.fn->builtin == builtin_if;
+  lval_del(f);
+  if (!is_if) { return NULL; }
+
+  lval* cond = lfold_arg(fold, lval_index(v, 1));
+  if (!cond) { return NULL; }
+  lval* branch = NULL;
+  if (lval_type(cond) == LVAL_NUM) {
+    branch = lval_index(v, lnum_is_true(cond) ? 2 : 3);
+  }
+  lval_del(cond);
+  return branch;
+}
+
+/* The value the items of "v" come to as an S-expression, or NULL. */
+lval* lfold_items(lfold* fold, lval* v) {
+  int n = lval_len(v);
+  if (n == 0) { return NULL; }
+  if (n == 1) { return lfold_value(fold, lval_index(v, 0)); }
+
+  lval* branch = lfold_branch(fold, v);
+  if (branch) { return lfold_items(fold, branch); }
+
+  lval* f = lfold_value(fold, lval_index(v, 0));
+  if (!f) { return NULL; }
+  if (lval_type(f) != LVAL_FUN || !f->data.fn->builtin_argv) {
+    lval_del(f);
+    return NULL;
+  }
+
+  lval** argv = calloc(n - 1, sizeof(lval*));
+  int known = 1;
+  for (int i = 1; i < n && known; i++) {
+    argv[i - 1] = lfold_arg(fold, lval_index(v, i));
+    known = argv[i - 1] != NULL;
+  }
+
+  lval* x = known ? f->data.fn->builtin_argv(fold->global, argv, n - 1) : NULL;
+  for (int i = 0; i < n - 1; i++) {
+    if (argv[i]) { lval_del(argv[i]); }
+  }
+  free(argv);
+  lval_del(f);
+
+  if (x && !lfold_usable(x)) {
+    lval_del(x);
+    x = NULL;
+  }
+  return x;
+}
+
+lval* lfold_show_items(lfold* fold, lval* v, lval* into);
+
+/* "x" as folded, for --dump-fold. Functions are left under their names,
+   though the code has their values too. */
+lval* lfold_show(lfold* fold, lval* x) {
+  lval* k = lfold_value(fold, x);
+  if (k && (lval_type(x) != LVAL_SYM || lval_type(k) != LVAL_FUN)) {
+    return k;
+  }
+  if (k) { lval_del(k); }
+
+  if (lval_type(x) == LVAL_SEXPR) {
+    return lfold_show_items(fold, x, lval_sexpr());
+  }
+  return lval_copy(x);
+}
+
+/* Add the items of "v" as folded to "into". */
+lval* lfold_show_items(lfold* fold, lval* v, lval* into) {
+  if (lval_len(v) == 1) {
+    return lval_add(into, lfold_show(fold, lval_index(v, 0)));
+  }
+  lval* k = lfold_items(fold, v);
+  if (k) { return lval_add(into, k); }
+
+  lval* branch = lfold_branch(fold, v);
+  if (branch) { return lfold_show_items(fold, branch, into); }
+
+  /* The branches of "if" are compiled inline, so are folded too. */
+  int inline_if = lval_len(v) == 4 &&
+    lval_type(lval_index(v, 0)) == LVAL_SYM &&
+    lval_index(v, 0)->data.sym == lsym_if &&
+    lval_type(lval_index(v, 2)) == LVAL_QEXPR &&
+    lval_type(lval_index(v, 3)) == LVAL_QEXPR;
+
+  for (int i = 0; i < lval_len(v); i++) {
+    lval* x = lval_index(v, i);
+    into = lval_add(into, inline_if && i >= 2
+                            ? lfold_show_items(fold, x, lval_qexpr())
+                            : lfold_show(fold, x));
+  }
+  return into;
+}
+
+/* Print the lambda being made with "body" as folded. */
+void lfold_dump(lfold* fold, lval* body) {
+  lval* shown = lfold_show_items(fold, body, lval_qexpr());
+  printf("Folded (\\ ");
+  lval_print(fold->f->data.fn->formals);
+  putchar(' ');
+  lval_print(shown);
+  puts(")");
+  lval_del(shown);
+}
+
+/* Bytecode.
+
+   A lambda body is compiled once, when the lambda is made, rather than
+   being copied and walked on every call. The compiled code does exactly
+   what the walker would: each element of an S-expression is pushed in
+   turn, a symbol's value looked up or a literal pushed as is, and LOP_APPLY
+   then hands the lot to lval_apply, which is what lval_eval uses too. A
+   builtin taking "argv" is passed its arguments where they are on the
+   stack instead, without making the S-expression at all. The other
+   shortcut is "if" with literal branches, whose branches are compiled
+   inline. Whether "if" is still the builtin is checked when it runs, and
+   if not the call is made as normal. A call in tail position is LOP_TAIL
+   instead, which goes on to the callee's code in the same lvm_run.
+
+   Anything folded, see lfold_value, gets LOP_FOLD in front of its ordinary
+   code, pushing the value folding found and jumping past it, or for an
+   "if" jumping to the branch it takes. Once a name it folded has been
+   rebound it falls through to the ordinary code instead, which is
+   compiled without folding. */
+void lcode_emit(lcode* c, int op) {
+  c->ops = realloc(c->ops, sizeof(int) * (c->count + 1));
+  c->ops[c->count++] = op;
+}
+
+int lcode_const(lcode* c, lval* v) {
+  c->consts = realloc(c->consts, sizeof(lval*) * (c->nconsts + 1));
+  c->consts[c->nconsts] = lval_copy(v);
+  return c->nconsts++;
+}
+
+/* Account for "n" more values on the operand stack. */
+void lcode_push(lcode* c, int* depth, int n) {
+  *depth += n;
+  if (*depth > c->max_stack) { c->max_stack = *depth; }
+}
+
+void lcode_sexpr(lcode* c, lval* v, int* depth, int tail);
+
+/* Superinstructions.
+
+   Most calls in a typical body are a builtin applied to a variable or two
+   and literals: (- n 1), (tail l), (== n 0). These get a fused instruction
+   in front of the ordinary code for the call, taking the function and
+   arguments straight from the frame or the constants, calling the builtin
+   on them there, and jumping past the ordinary code. Whether the function
+   is still a builtin taking "argv" is checked when it runs, and if not the
+   ordinary code runs as if the fused instruction weren't there. Those
+   builtins have no side effects, so one whose result isn't usable can be
+   called again that way too. A call like that as the condition of "if"
+   is fused with the branch as well. */
+int lcode_fusable(lval* v, int n) {
+  if (lopts.no_fuse || lval_len(v) != n ||
+      lval_type(lval_index(v, 0)) != LVAL_SYM) {
+    return 0;
+  }
+  for (int i = 1; i < n; i++) {
+    if (lval_type(lval_index(v, i)) == LVAL_SEXPR) { return 0; }
+  }
+  return 1;
+}
+
+/* Emit the items of "v", an S-expression lcode_fusable allows, as
+   operands of a fused instruction. A name folding found the value of is
+   given that instead, which the instruction only trusts while the names
+   folded are still bound as they were. */
+void lcode_fuse(lcode* c, lval* v) {
+  for (int i = 0; i < lval_len(v); i++) {
+    lval* x = lval_index(v, i);
+    lval* k = c->fold && lval_type(x) == LVAL_SYM ? lfold_value(c->fold, x)
+                                                   : NULL;
+    lcode_emit(c, lcode_const(c, k ? k : x));
+    if (k) { lval_del(k); }
+  }
+}
+
+/* Emit LOP_FOLD ahead of the code for something that comes to "k",
+   pushing it if "push". Returns where the operand saying where the
+   instruction jumps to is. */
+int lcode_fold(lcode* c, lval* k, int push) {
+  lcode_emit(c, LOP_FOLD);
+  lcode_emit(c, push ? lcode_const(c, k) : -1);
+  lcode_emit(c, 0);
+  return c->count - 1;
+}
+
+/* Compile code leaving the value of "x" on the stack. */
+void lcode_expr(lcode* c, lval* x, int* depth) {
+  switch (lval_type(x)) {
+    case LVAL_SYM: {
+      lval* k = c->fold ? lfold_value(c->fold, x) : NULL;
+      int folded = k ? lcode_fold(c, k, 1) : -1;
+      if (k) { lval_del(k); }
+
+      lcode_emit(c, LOP_LOAD);
+      lcode_emit(c, lcode_const(c, x));
+      lcode_push(c, depth, 1);
+      if (folded >= 0) { c->ops[folded] = c->count; }
+      break;
+    }
+
+    case LVAL_SEXPR: lcode_sexpr(c, x, depth, 0); break;
+
+    default:
+      lcode_emit(c, LOP_CONST);
+      lcode_emit(c, lcode_const(c, x));
+      lcode_push(c, depth, 1);
+      break;
+  }
+}
+
+/* The ordinary code for lcode_sexpr. */
+void lcode_call(lcode* c, lval* v, int* depth, int tail) {
+  int n = lval_len(v);
+
+  if (n == 4 && lval_type(lval_index(v, 0)) == LVAL_SYM &&
+      lval_index(v, 0)->data.sym == lsym_if &&
+      lval_type(lval_index(v, 2)) == LVAL_QEXPR &&
+      lval_type(lval_index(v, 3)) == LVAL_QEXPR) {
+    lval* cond = lval_index(v, 1);
+    lval* branch = c->fold ? lfold_branch(c->fold, v) : NULL;
+    int folded = branch ? lcode_fold(c, NULL, 0) : -1;
+
+    int fused = -1;
+    if (lval_type(cond) == LVAL_SEXPR && lcode_fusable(cond, 3)) {
+      fused = c->count;
+      lcode_emit(c, LOP_IF_CALL2);
+      lcode_emit(c, lcode_const(c, lval_index(v, 0)));
+      lcode_fuse(c, cond);
+      lcode_emit(c, 0);
+      lcode_emit(c, 0);
+    }
+
+    /* Function and condition, then LOP_IF decides how to go on. If it
+       makes the call itself the branches are pushed first. */
+    lcode_expr(c, lval_index(v, 0), depth);
+    lcode_expr(c, lval_index(v, 1), depth);
+    lcode_push(c, depth, 2);
+    *depth -= 4;
+
+    lcode_emit(c, LOP_IF);
+    lcode_emit(c, lcode_const(c, lval_index(v, 2)));
+    lcode_emit(c, lcode_const(c, lval_index(v, 3)));
+    int at = c->count;
+    lcode_emit(c, 0);
+    lcode_emit(c, 0);
+    if (fused >= 0) { c->ops[fused + 5] = c->count; }
+    if (branch == lval_index(v, 2)) { c->ops[folded] = c->count; }
+
+    lcode_sexpr(c, lval_index(v, 2), depth, tail);
+    lcode_emit(c, LOP_JUMP);
+    lcode_emit(c, 0);
+    int jump = c->count - 1;
+    *depth -= 1;
+
+    c->ops[at] = c->count;
+    if (fused >= 0) { c->ops[fused + 6] = c->count; }
+    if (branch == lval_index(v, 3)) { c->ops[folded] = c->count; }
+    lcode_sexpr(c, lval_index(v, 3), depth, tail);
+    c->ops[at + 1] = c->count;
+    c->ops[jump] = c->count;
+    return;
+  }
+
+  int fused = -1;
+  if ((n == 2 || n == 3) && lcode_fusable(v, n)) {
+    fused = c->count;
+    lcode_emit(c, n == 2 ? LOP_CALL1 : LOP_CALL2);
+    lcode_fuse(c, v);
+    lcode_emit(c, 0);
+  }
+
+  for (int i = 0; i < n; i++) {
+    lcode_expr(c, lval_index(v, i), depth);
+  }
+  lcode_emit(c, tail ? LOP_TAIL : LOP_APPLY);
+  lcode_emit(c, n);
+  *depth -= n;
+  lcode_push(c, depth, 1);
+
+  /* In tail position too the result is left for the LOP_RET after. */
+  if (fused >= 0) { c->ops[fused + n + 1] = c->count; }
+}
+
+/* Compile code leaving the value of the S-expression made of the items
+   of "v" on the stack, or if it is in "tail" position returning it. */
+void lcode_sexpr(lcode* c, lval* v, int* depth, int tail) {
+  lval* k = c->fold ? lfold_items(c->fold, v) : NULL;
+  if (!k) {
+    lcode_call(c, v, depth, tail);
+    return;
+  }
+
+  int folded = lcode_fold(c, k, 1);
+  lval_del(k);
+  lfold* fold = c->fold;
+  c->fold = NULL;
+  lcode_call(c, v, depth, tail);
+  c->fold = fold;
+  c->ops[folded] = c->count;
+}
+
+/* Compile "body", folding it with "fold" unless that is NULL. */
+lcode* lcode_compile(lval* body, lfold* fold) {
+  lcode* c = malloc(sizeof(lcode));
+  c->refs = 1;
+  c->count = 0;
+  c->ops = NULL;
+  c->nconsts = 0;
+  c->consts = NULL;
+  c->max_stack = 0;
+  c->nguards = 0;
+  c->guards = NULL;
+  c->checked = lfold_epoch;
+  c->fold = fold;
+  if (fold) { fold->code = c; }
+#ifdef LISPY_JIT
+  c->calls = 0;
+  c->jit = NULL;
+#endif
+#ifdef LISPY_GC
+  c->gc_mark = lgc.epoch;
+#endif
+
+  int depth = 0;
+  lcode_sexpr(c, body, &depth, 1);
+  lcode_emit(c, LOP_RET);
+  if (fold) { fold->code = NULL; }
+  c->fold = NULL;
+  return c;
+}
+
+/* The operand stack, shared by every running piece of code. It may move
+   when it grows, so it is only ever indexed. */
+_Thread_local struct {
+  lval** items;
+  int top;
+  int capacity;
+#ifdef LISPY_VM_STATS
+  long counts[LOP_COUNT];
+  long misses;
+#endif
+} lvm;
+
+lval* lval_apply(lenv* e, lval* v);
+lval* lval_apply_tail(lenv* e, lval* v, lval** x, lval** f);
+lval* lval_eval_items(lenv* e, lval* v);
+lval* lval_body(lval* f);
+void lfun_refresh(lenv* e, lval* f);
+
+/* Pop the top "n" values into an S-expression. */
+lval* lvm_pop(int n) {
+  lval* v = lval_new(LVAL_SEXPR);
+  v->data.sexprs = lcells_new(n);
+  lvm.top -= n;
+  memcpy(v->data.sexprs->cell, &lvm.items[lvm.top], sizeof(lval*) * n);
+  v->data.sexprs->count = n;
+  return v;
+}
+
+/* If the top "n" values are a call to a builtin taking "argv", with no
+   errors among its arguments, make it with them where they are on the
+   stack and pop them. Otherwise return NULL, for lval_apply to deal with. */
+lval* lvm_call_argv(lenv* e, int n) {
+  lval** v = &lvm.items[lvm.top - n];
+  if (n < 2 || lval_type(v[0]) != LVAL_FUN || !v[0]->data.fn->builtin_argv) {
+    return NULL;
+  }
+  for (int i = 1; i < n; i++) {
+    if (lval_type(v[i]) == LVAL_ERR) { return NULL; }
+  }
+
+  lval* x = v[0]->data.fn->builtin_argv(e, v + 1, n - 1);
+  for (int i = 0; i < n; i++) { lval_del(v[i]); }
+  lvm.top -= n;
+  return x;
+}
+
+/* The value of an operand of a fused instruction, the constant at index
+   "i": a symbol's value, or a literal as is. */
+static inline lval* lvm_operand(lenv* e, lcode* c, int i) {
+  lval* x = c->consts[i];
+  return lval_type(x) == LVAL_SYM ? lenv_get(e, x) : lval_copy(x);
+}
+
+/* Whether the names "c" folded are still bound as they were, having
+   been rebound since lfold_epoch last moved on. */
+int lcode_recheck(lcode* c) {
+  for (int i = 0; i < c->nguards; i++) {
+    if (lsym_version(c->guards[i].sym) != c->guards[i].version) {
+      return 0;
+    }
+  }
+  c->checked = lfold_epoch;
+  return 1;
+}
+
+/* Whether what "c" folded still holds. Only names it folded are checked,
+   and only once each time any global is rebound. */
+static inline int lvm_folds_hold(lcode* c) {
+  return c->checked == lfold_epoch || lcode_recheck(c);
+}
+
+/* Make the call a fused instruction stands for, with the function and
+   "argc" arguments given by the operands at "ops". Returns NULL if the
+   function isn't a builtin taking "argv", or an argument is an error. */
+lval* lvm_call_fused(lenv* e, lcode* c, int* ops, int argc) {
+  if (!lvm_folds_hold(c)) { return NULL; }
+  lval* f = lvm_operand(e, c, ops[0]);
+  lval* x = NULL;
+  if (lval_type(f) == LVAL_FUN && f->data.fn->builtin_argv) {
+    lval* argv[2];
+    int ok = 1;
+    for (int i = 0; i < argc; i++) {
+      argv[i] = lvm_operand(e, c, ops[i + 1]);
+      if (lval_type(argv[i]) == LVAL_ERR) { ok = 0; }
+    }
+    if (ok) { x = f->data.fn->builtin_argv(e, argv, argc); }
+    for (int i = 0; i < argc; i++) { lval_del(argv[i]); }
+  }
+  lval_del(f);
+  return x;
+}
+
+/* Make room on the stack for everything "c" may push. */
+void lvm_reserve(lcode* c) {
+  if (lvm.top + c->max_stack > lvm.capacity) {
+    while (lvm.top + c->max_stack > lvm.capacity) {
+      lvm.capacity = lvm.capacity ? lvm.capacity * 2 : 256;
+    }
+    lvm.items = realloc(lvm.items, sizeof(lval*) * lvm.capacity);
+  }
+}
+
+/* Dispatch. With GCC's labels as values, each instruction ends by jumping
+   straight to the handler for the next through lvm_labels, rather than
+   going back round to the one switch, so each handler has its own
+   indirect branch for the predictor to learn. Build with
+   -DLISPY_SWITCH_DISPATCH, or without GCC, for the plain switch, and with
+   -DLISPY_VM_STATS to count the instructions run and the fused ones that
+   fell back to the ordinary code, see builtin_vm. */
+#if defined(__GNUC__) && !defined(LISPY_SWITCH_DISPATCH)
+#define LVM_THREADED
+#endif
+
+#ifdef LISPY_VM_STATS
+#define LVM_COUNT() (lvm.counts[ops[pc]]++)
+#define LVM_MISS() (lvm.misses++)
+#else
+#define LVM_COUNT()
+#define LVM_MISS()
+#endif
+
+#ifdef LVM_THREADED
+#define LVM_CASE(op) case op: lvm_##op
+#define LVM_NEXT() do { LVM_COUNT(); goto *lvm_labels[ops[pc]]; } while (0)
+#else
+#define LVM_CASE(op) case op
+#define LVM_NEXT() continue
+#endif
+
+lval* lvm_run(lenv* e, lcode* c) {
+#ifdef LVM_THREADED
+  static const void* lvm_labels[] = {
+    [LOP_CONST] = &&lvm_LOP_CONST, [LOP_LOAD] = &&lvm_LOP_LOAD,
+    [LOP_APPLY] = &&lvm_LOP_APPLY, [LOP_TAIL] = &&lvm_LOP_TAIL,
+    [LOP_IF] = &&lvm_LOP_IF, [LOP_JUMP] = &&lvm_LOP_JUMP,
+    [LOP_RET] = &&lvm_LOP_RET, [LOP_FOLD] = &&lvm_LOP_FOLD,
+    [LOP_CALL1] = &&lvm_LOP_CALL1, [LOP_CALL2] = &&lvm_LOP_CALL2,
+    [LOP_IF_CALL2] = &&lvm_LOP_IF_CALL2,
+  };
+#endif
+  lvm_reserve(c);
+  lcode_ref(c);
+
+  ltail t = { .f = NULL };
+  lval* result;
+  int* ops = c->ops;
+  int pc = 0;
+  for (;;) {
+    LVM_COUNT();
+    switch (ops[pc]) {
+      LVM_CASE(LOP_CONST):
+        lvm.items[lvm.top++] = lval_copy(c->consts[ops[pc + 1]]);
+        pc += 2;
+        LVM_NEXT();
+
+      LVM_CASE(LOP_LOAD):
+        lvm.items[lvm.top++] = lenv_get(e, c->consts[ops[pc + 1]]);
+        pc += 2;
+        LVM_NEXT();
+
+      LVM_CASE(LOP_APPLY): {
+        lval* x = lvm_call_argv(e, ops[pc + 1]);
+        if (!x) { x = lval_apply(e, lvm_pop(ops[pc + 1])); }
+        lvm.items[lvm.top++] = x;
+        pc += 2;
+        LVM_NEXT();
+      }
+
+      LVM_CASE(LOP_TAIL): {
+        result = lvm_call_argv(e, ops[pc + 1]);
+        if (result) { goto done; }
+
+        /* An expression the call comes to is evaluated here too, so that a
+           tail call made by way of "if" or "eval" doesn't nest either. */
+        lval* x = lvm_pop(ops[pc + 1]);
+        lval* f;
+        do {
+          result = lval_apply_tail(e, x, &x, &f);
+          if (result) { goto done; }
+          if (f) {
+            e = ltail_enter(&t, e, f, x);
+            x = f->data.fn->code ? NULL : lval_body(f);
+          }
+          if (x) { x = lval_eval_items(e, x); }
+        } while (x);
+
+        /* Go on to the callee's code, in its frame. */
+        lfun_refresh(e, f);
+        lcode_ref(f->data.fn->code);
+        lcode_del(c);
+        c = f->data.fn->code;
+        lvm_reserve(c);
+        ops = c->ops;
+        pc = 0;
+        LVM_NEXT();
+      }
+
+      LVM_CASE(LOP_IF): {
+        lval* f = lvm.items[lvm.top - 2];
+        lval* cond = lvm.items[lvm.top - 1];
+        if (lval_type(f) == LVAL_FUN && f->data.fn->builtin == builtin_if &&
+            lval_type(cond) == LVAL_NUM) {
+          int taken = lnum_is_true(cond);
+          lval_del(f);
+          lval_del(cond);
+          lvm.top -= 2;
+          pc = taken ? pc + 5 : ops[pc + 3];
+        } else {
+          lvm.items[lvm.top++] = lval_copy(c->consts[ops[pc + 1]]);
+          lvm.items[lvm.top++] = lval_copy(c->consts[ops[pc + 2]]);
+          lval* x = lval_apply(e, lvm_pop(4));
+          lvm.items[lvm.top++] = x;
+          pc = ops[pc + 4];
+        }
+        LVM_NEXT();
+      }
+
+      LVM_CASE(LOP_JUMP):
+        pc = ops[pc + 1];
+        LVM_NEXT();
+
+      LVM_CASE(LOP_RET):
+        result = lvm.items[--lvm.top];
+        goto done;
+
+      LVM_CASE(LOP_FOLD):
+        if (lvm_folds_hold(c)) {
+          if (ops[pc + 1] >= 0) {
+            lvm.items[lvm.top++] = lval_copy(c->consts[ops[pc + 1]]);
+          }
+          pc = ops[pc + 2];
+        } else {
+          LVM_MISS();
+          pc += 3;
+        }
+        LVM_NEXT();
+
+      LVM_CASE(LOP_CALL1):
+      LVM_CASE(LOP_CALL2): {
+        int argc = ops[pc] == LOP_CALL1 ? 1 : 2;
+        lval* x = lvm_call_fused(e, c, &ops[pc + 1], argc);
+        if (x) {
+          lvm.items[lvm.top++] = x;
+          pc = ops[pc + argc + 2];
+        } else {
+          LVM_MISS();
+          pc += argc + 3;
+        }
+        LVM_NEXT();
+      }
+
+      LVM_CASE(LOP_IF_CALL2): {
+        lval* f = lvm_folds_hold(c) ? lvm_operand(e, c, ops[pc + 1]) : NULL;
+        int fast = f && lval_type(f) == LVAL_FUN &&
+                   f->data.fn->builtin == builtin_if;
+        if (f) { lval_del(f); }
+
+        lval* x = fast ? lvm_call_fused(e, c, &ops[pc + 2], 2) : NULL;
+        if (x && lval_type(x) == LVAL_NUM) {
+          pc = lnum_is_true(x) ? ops[pc + 5] : ops[pc + 6];
+        } else {
+          LVM_MISS();
+          pc += 7;
+        }
+        if (x) { lval_del(x); }
+        LVM_NEXT();
+      }
+    }
+  }
+
+done:
+  lcode_del(c);
+  ltail_leave(&t);
+  return result;
+}
+
+/* Compile the body of the lambda "f", made or called in "e", folding
+   what it can with the globals there, and print it as folded if "dump". */
+void lfun_compile(lenv* e, lval* f, int dump) {
+  while (e->parent) { e = e->parent; }
+  lfold fold = { e, f, NULL };
+  /* With dynamic scope what a name means depends on the caller. */
+  int folding = !lopts.dynamic_scope && !lopts.no_fold;
+
+  lval* body = f->data.fn->body;
+  f->data.fn->code = lcode_compile(body, folding ? &fold : NULL);
+  if (folding && dump) { lfold_dump(&fold, body); }
+}
+
+/* Before the lambda "f" is called from "e", compile it again if a name it
+   folded has been rebound since, so that it runs as folded from then on
+   rather than falling back to the ordinary code each time. Code already
+   running holds its own reference, see lvm_run. */
+void lfun_refresh(lenv* e, lval* f) {
+  lcode* c = f->data.fn->code;
+  if (lvm_folds_hold(c)) { return; }
+
+  lcode_del(c);
+  lfun_compile(e, f, 0);
+#ifndef LISPY_NO_NURSERY
+  lcode_tenure(f->data.fn->code);
+#endif
+}
+
 lval* builtin_lambda(lenv* e, lval* a) {
   LASSERT_ARG_COUNT(a, 2, "\\");
   LASSERT_ARG_TYPE(a, 0, LVAL_QEXPR, "\\");
   LASSERT_ARG_TYPE(a, 1, LVAL_QEXPR, "\\");
+  lval_flatten(a->data.sexprs->cell[0]);
 
-  for (int i = 0; i < a->data.sexprs.cell[0]->data.sexprs.count; i++) {
-    int t = a->data.sexprs.cell[0]->data.sexprs.cell[i]->type;
+  for (int i = 0; i < a->data.sexprs->cell[0]->data.sexprs->count; i++) {
+    int t = lval_type(a->data.sexprs->cell[0]->data.sexprs->cell[i]);
     LASSERT(a, t == LVAL_SYM, "Cannot define non symbol.");
   }
 
@@ -549,136 +3536,154 @@ lval* builtin_lambda(lenv* e, lval* a) {
   lval* body = lval_pop(a, 0);
   lval_del(a);
 
-  return lval_lambda(formals, body);
-}
-
-lval* builtin_cmp(lenv* e, lval* a, char* op) {
-  LASSERT_ARG_COUNT(a, 2, op);
-  int eq;
-  if (strcmp(op, "==") == 0) {
-    eq = lval_eq(a->data.sexprs.cell[0], a->data.sexprs.cell[1]);
-  }
-  if (strcmp(op, "!=") == 0) {
-    eq = !lval_eq(a->data.sexprs.cell[0], a->data.sexprs.cell[1]);
+  lval* f = lval_lambda(formals, body);
+  if (!lopts.dynamic_scope) {
+    lval_capture(e, f, body);
+    lenv* global = e;
+    while (global->parent) { global = global->parent; }
+    f->data.fn->env->parent = global;
   }
 
-  lval_del(a);
-  return lval_num(eq);
+  lval_resolve(e, f->data.fn->env, formals, body);
+  if (!lopts.tree_walk) { lfun_compile(e, f, lopts.dump_fold); }
+  return f;
 }
 
-lval* builtin_eq(lenv* e, lval* a) { return builtin_cmp(e, a, "=="); }
-lval* builtin_neq(lenv* e, lval* a) { return builtin_cmp(e, a, "!="); }
-
-lval* builtin_ord(lenv* e, lval* a, char* op) {
-  LASSERT_ARG_COUNT(a, 2, op);
-  LASSERT_ARG_TYPE(a, 0, LVAL_NUM, op);
-  LASSERT_ARG_TYPE(a, 1, LVAL_NUM, op);
-
-  lval* x = lval_pop(a, 0);
-  lval* y = lval_pop(a, 0);
-
-  if (strcmp(op, ">") == 0) { x->data.num = x->data.num > y->data.num; }
-  if (strcmp(op, "<") == 0) { x->data.num = x->data.num < y->data.num; }
-  if (strcmp(op, "<=") == 0) { x->data.num = x->data.num <= y->data.num; }
-  if (strcmp(op, ">=") == 0) { x->data.num = x->data.num >= y->data.num; }
-
-  lval_del(y);
-  lval_del(a);
+/* Take over the argument at "i" from the caller, so that if nothing else
+   holds it, it can be changed in place. A number is left behind, which
+   costs nothing to drop. */
+lval* largv_take(lval** argv, int i) {
+  lval* x = argv[i];
+  argv[i] = lval_num(0);
   return x;
 }
 
-lval* builtin_gt(lenv* e, lval* a) { return builtin_ord(e, a, ">"); }
-lval* builtin_lt(lenv* e, lval* a) { return builtin_ord(e, a, "<"); }
-lval* builtin_gte(lenv* e, lval* a) { return builtin_ord(e, a, ">="); }
-lval* builtin_lte(lenv* e, lval* a) { return builtin_ord(e, a, "<="); }
-
-lval* builtin_op(lenv* e, lval* a, char* op) {
-  /* Ensure all arguments are numbers. */
-  for (int i = 0; i < a->data.sexprs.count; i++) {
-    LASSERT_ARG_TYPE(a, i, LVAL_NUM, op);
+/* Comparison, ordering and arithmetic. Each operator is its own builtin,
+   generated from the expression that computes it, so nothing is looked up
+   by name while it runs. */
+#define LBUILTIN_CMP(name, op, test) \
+  lval* name(lenv* e, lval** argv, int argc) { \
+    LCHECK_ARG_COUNT(argc, 2, op); \
+    lval* x = argv[0]; \
+    lval* y = argv[1]; \
+    return lval_num(test); \
   }
 
-  /* Pop the first element. */
-  lval* x = lval_pop(a, 0);
+LBUILTIN_CMP(builtin_eq, "==", lval_eq(x, y))
+LBUILTIN_CMP(builtin_neq, "!=", !lval_eq(x, y))
 
-  /* If no arguments and sub then perform unary negations. */
-  if (a->data.sexprs.count == 0 &&
-      strcmp(op, "-") == 0) {
-    x->data.num = -x->data.num;
+#define LBUILTIN_ORD(name, op, rel) \
+  lval* name(lenv* e, lval** argv, int argc) { \
+    LCHECK_ARG_COUNT(argc, 2, op); \
+    LCHECK_ARG_TYPE(argv, 0, LVAL_NUM, op); \
+    LCHECK_ARG_TYPE(argv, 1, LVAL_NUM, op); \
+    return lval_num(lnum_cmp(argv[0], argv[1]) rel 0); \
   }
 
-  /* While there are still elements remaining. */
-  while (a->data.sexprs.count > 0) {
-    /* Pop the next element. */
-    lval* y = lval_pop(a, 0);
-
-    /* Basic math operators. */
-    if (strcmp(op, "+") == 0) { x->data.num += y->data.num; }
-    if (strcmp(op, "-") == 0) { x->data.num -= y->data.num; }
-    if (strcmp(op, "*") == 0) { x->data.num *= y->data.num; }
-    if (strcmp(op, "/") == 0) {
-      if (y->data.num == 0) {
-        lval_del(x);
-        lval_del(y);
-        x = lval_err("Division by zero!");
-        break;
-      }
-      x->data.num /= y->data.num;
-    }
-
-    /* Extra math operators. */
-    if (strcmp(op, "%") == 0) { x->data.num %= y->data.num; }
-    if (strcmp(op, "^") == 0) { x->data.num = (long)pow(x->data.num, y->data.num); }
-
-    lval_del(y);
+LBUILTIN_ORD(builtin_gt, ">", >)
+LBUILTIN_ORD(builtin_lt, "<", <)
+LBUILTIN_ORD(builtin_gte, ">=", >=)
+LBUILTIN_ORD(builtin_lte, "<=", <=)
+
+/* "small" folds each argument after the first, "y", into "x" as longs,
+   putting the result in "r", and is true if it didn't fit. From there on,
+   or from the first bignum or double, "big" carries on with whole
+   Numbers. With a single argument the result
+   is "x", or 0 - "x" if "negate". */
+#define LBUILTIN_OP(name, op, negate, small, big) \
+  lval* name(lenv* e, lval** argv, int argc) { \
+    for (int i = 0; i < argc; i++) { \
+      LCHECK_ARG_TYPE(argv, i, LVAL_NUM, op); \
+    } \
+    lval* first = argv[0]; \
+    int i = 1; \
+    if (argc == 1 && negate) { \
+      first = lval_num(0); \
+      i = 0; \
+    } \
+    lval* acc; \
+    if (!lval_is_long(first)) { \
+      acc = lval_copy(first); \
+    } else { \
+      long x = lval_long(first); \
+      for (; i < argc && lval_is_long(argv[i]); i++) { \
+        long y = lval_long(argv[i]); \
+        long r; \
+        if (small) { break; } \
+        x = r; \
+      } \
+      acc = lval_num(x); \
+    } \
+    for (; i < argc && lval_type(acc) != LVAL_ERR; i++) { \
+      lval* r = big(acc, argv[i]); \
+      lval_del(acc); \
+      acc = r; \
+    } \
+    return acc; \
   }
 
-  lval_del(a);
-  return x;
-}
-
-lval* builtin_add(lenv* e, lval* a) { return builtin_op(e, a, "+"); }
-lval* builtin_sub(lenv* e, lval* a) { return builtin_op(e, a, "-"); }
-lval* builtin_mul(lenv* e, lval* a) { return builtin_op(e, a, "*"); }
-lval* builtin_div(lenv* e, lval* a) { return builtin_op(e, a, "/"); }
-lval* builtin_mod(lenv* e, lval* a) { return builtin_op(e, a, "%"); }
-lval* builtin_pow(lenv* e, lval* a) { return builtin_op(e, a, "^"); }
+LBUILTIN_OP(builtin_add, "+", 0, __builtin_add_overflow(x, y, &r), lnum_add)
+LBUILTIN_OP(builtin_sub, "-", 1, __builtin_sub_overflow(x, y, &r), lnum_sub)
+LBUILTIN_OP(builtin_mul, "*", 0, __builtin_mul_overflow(x, y, &r), lnum_mul)
+LBUILTIN_OP(builtin_div, "/", 0, ldiv_overflow(x, y, &r), lnum_div)
+LBUILTIN_OP(builtin_mod, "%", 0, lmod_overflow(x, y, &r), lnum_mod)
+LBUILTIN_OP(builtin_pow, "^", 0, lpow_overflow(x, y, &r), lnum_pow)
 
-lval* builtin_head(lenv* e, lval* a) {
+lval* builtin_head(lenv* e, lval** argv, int argc) {
   /* Check error conditions. */
-  LASSERT_ARG_COUNT(a, 1, "head");
-  LASSERT_ARG_TYPE(a, 0, LVAL_QEXPR, "head");
-  LASSERT_ARG_NOT_EMPTY_LIST(a, 0, "head");
+  LCHECK_ARG_COUNT(argc, 1, "head");
+  LCHECK_ARG_TYPE(argv, 0, LVAL_QEXPR, "head");
+  LCHECK_ARG_NOT_EMPTY_LIST(argv, 0, "head");
+
+  lval* v = largv_take(argv, 0);
+  if (v->type == LVAL_VEC) { return lval_vslice(v, 0, 1); }
+  if (lval_shared(v)) { return lval_slice(v, 0, 1); }
 
-  lval* v = lval_take(a, 0);
-  while (v->data.sexprs.count > 1) { lval_del(lval_pop(v, 1)); }
+  while (v->data.sexprs->count > 1) {
+    lval_del(lval_pop(v, v->data.sexprs->count - 1));
+  }
   return v;
 }
 
-lval* builtin_tail(lenv* e, lval* a) {
+lval* builtin_tail(lenv* e, lval** argv, int argc) {
   /* Check error conditions. */
-  LASSERT_ARG_COUNT(a, 1, "tail");
-  LASSERT_ARG_TYPE(a, 0, LVAL_QEXPR, "tail");
-  LASSERT_ARG_NOT_EMPTY_LIST(a, 0, "tail");
+  LCHECK_ARG_COUNT(argc, 1, "tail");
+  LCHECK_ARG_TYPE(argv, 0, LVAL_QEXPR, "tail");
+  LCHECK_ARG_NOT_EMPTY_LIST(argv, 0, "tail");
+
+  lval* v = largv_take(argv, 0);
+  if (v->type == LVAL_VEC) { return lval_vslice(v, 1, lval_len(v) - 1); }
+  if (lval_shared(v)) {
+    return lval_slice(v, 1, v->data.sexprs->count - 1);
+  }
 
-  lval* v = lval_take(a, 0);
   lval_del(lval_pop(v, 0));
   return v;
 }
 
-lval* builtin_list(lenv* e, lval* a) {
-  a->type = LVAL_QEXPR;
-  return a;
+lval* builtin_list(lenv* e, lval** argv, int argc) {
+  lval* v = lval_new(LVAL_QEXPR);
+  v->data.sexprs = lcells_new(argc);
+  for (int i = 0; i < argc; i++) {
+    v->data.sexprs->cell[i] = largv_take(argv, i);
+  }
+  v->data.sexprs->count = argc;
+  return v;
 }
 
-lval* builtin_cons(lenv* e, lval* a) {
-  LASSERT_ARG_COUNT(a, 2, "cons");
-  LASSERT_ARG_TYPE(a, 1, LVAL_QEXPR, "cons");
+lval* builtin_cons(lenv* e, lval** argv, int argc) {
+  LCHECK_ARG_COUNT(argc, 2, "cons");
+  LCHECK_ARG_TYPE(argv, 1, LVAL_QEXPR, "cons");
 
-  lval* v = lval_add(lval_qexpr(), lval_pop(a, 0));
-  lval* q = lval_take(a, 0);
+  lval* v = lval_add(lval_qexpr(), largv_take(argv, 0));
+  if (argv[1]->type == LVAL_VEC || lval_len(argv[1]) >= LVEC_MIN) {
+    return lval_vjoin(v, largv_take(argv, 1));
+  }
+
+  lval* q = lval_unshare(largv_take(argv, 1));
+  v->data.sexprs = lcells_reserve(v->data.sexprs, q->data.sexprs->count);
 
-  while (q->data.sexprs.count) {
+  while (q->data.sexprs->count) {
     lval_add(v, lval_pop(q, 0));
   }
 
@@ -687,54 +3692,125 @@ lval* builtin_cons(lenv* e, lval* a) {
   return v;
 }
 
-lval* builtin_len(lenv* e, lval* a) {
-  LASSERT_ARG_COUNT(a, 1, "len");
-  LASSERT_ARG_TYPE(a, 0, LVAL_QEXPR, "len");
+lval* builtin_len(lenv* e, lval** argv, int argc) {
+  LCHECK_ARG_COUNT(argc, 1, "len");
+  LCHECK_ARG_TYPE(argv, 0, LVAL_QEXPR, "len");
+
+  return lval_num(lval_len(argv[0]));
+}
+
+lval* builtin_nth(lenv* e, lval** argv, int argc) {
+  LCHECK_ARG_COUNT(argc, 2, "nth");
+  LCHECK_ARG_TYPE(argv, 0, LVAL_NUM, "nth");
+  LCHECK_ARG_TYPE(argv, 1, LVAL_QEXPR, "nth");
 
-  int n = a->data.sexprs.cell[0]->data.sexprs.count;
-  lval_del(lval_pop(a, 0));
+  lval* q = argv[1];
+  LCHECK(!lval_is_dbl(argv[0]), "\"nth\" index must be a whole number.");
+  LCHECK(!lval_is_big(argv[0]),
+         "\"nth\" index is out of range for a list of %i.", lval_len(q));
 
-  a->type = LVAL_NUM;
-  a->data.num = n;
+  long i = lval_long(argv[0]);
+  LCHECK(i >= 0 && i < lval_len(q),
+         "\"nth\" index %li is out of range for a list of %i.",
+         i, lval_len(q));
 
-  return a;
+  return lval_copy(lval_index(q, i));
 }
 
-lval* builtin_init(lenv* e, lval* a) {
-  LASSERT_ARG_COUNT(a, 1, "init");
-  LASSERT_ARG_TYPE(a, 0, LVAL_QEXPR, "init");
-  LASSERT_ARG_NOT_EMPTY_LIST(a, 0, "init");
+lval* builtin_init(lenv* e, lval** argv, int argc) {
+  LCHECK_ARG_COUNT(argc, 1, "init");
+  LCHECK_ARG_TYPE(argv, 0, LVAL_QEXPR, "init");
+  LCHECK_ARG_NOT_EMPTY_LIST(argv, 0, "init");
+
+  lval* v = largv_take(argv, 0);
+  if (v->type == LVAL_VEC) { return lval_vslice(v, 0, lval_len(v) - 1); }
+  if (lval_shared(v)) {
+    return lval_slice(v, 0, v->data.sexprs->count - 1);
+  }
 
-  lval* v = lval_take(a, 0);
-  lval_del(lval_pop(v, v->data.sexprs.count - 1));
+  lval_del(lval_pop(v, v->data.sexprs->count - 1));
 
   return v;
 }
 
-lval* builtin_eval(lenv* e, lval* a) {
+/* The Q-expression "eval" is given, as an S-expression. */
+lval* lval_eval_expr(lval* a) {
   LASSERT_ARG_COUNT(a, 1, "eval");
   LASSERT_ARG_TYPE(a, 0, LVAL_QEXPR, "eval");
 
-  lval* x = lval_take(a, 0);
+  lval* x = lval_unshare(lval_take(a, 0));
   x->type = LVAL_SEXPR;
+  return x;
+}
+
+lval* builtin_eval(lenv* e, lval* a) {
+  lval* x = lval_eval_expr(a);
+  if (lval_type(x) == LVAL_ERR) { return x; }
   return lval_eval(e, x);
 }
 
-lval* builtin_join(lenv* e, lval* a) {
-  for (int i = 0; i < a->data.sexprs.count; i++) {
-    LASSERT_ARG_TYPE(a, i, LVAL_QEXPR, "join");
+lval* builtin_join(lenv* e, lval** argv, int argc) {
+  for (int i = 0; i < argc; i++) {
+    LCHECK_ARG_TYPE(argv, i, LVAL_QEXPR, "join");
   }
 
-  lval* x = lval_pop(a, 0);
+  lval* x = largv_take(argv, 0);
 
-  while (a->data.sexprs.count) {
-    x = lval_join(x, lval_pop(a, 0));
+  for (int i = 1; i < argc; i++) {
+    x = lval_join(x, largv_take(argv, i));
   }
 
-  lval_del(a);
   return x;
 }
 
+#ifdef LISPY_GC
+/* Collector statistics, as {collections freed total-pause-us max-pause-us
+   live-bytes live-objects}. Live bytes are as of the last collection. The
+   arguments are ignored, as a lone "gc" evaluates to the builtin itself. */
+lval* builtin_gc(lenv* e, lval* a) {
+  lval_del(a);
+
+  lval* v = lval_qexpr();
+  v = lval_add(v, lval_num(lgc.collections));
+  v = lval_add(v, lval_num(lgc.freed));
+  v = lval_add(v, lval_num((long)(lgc.pause_total * 1e6)));
+  v = lval_add(v, lval_num((long)(lgc.pause_max * 1e6)));
+  v = lval_add(v, lval_num(lgc.live_bytes));
+  v = lval_add(v, lval_num(lgc.objects));
+  return v;
+}
+#endif
+#ifdef LISPY_ALLOC_STATS
+lval* lpool_stats(lpool* p) {
+  lval* v = lval_qexpr();
+  v = lval_add(v, lval_num(p->allocs));
+  v = lval_add(v, lval_num(p->frees));
+  v = lval_add(v, lval_num(p->allocs - p->frees));
+  v = lval_add(v, lval_num(p->slabs));
+  return v;
+}
+
+/* Pool statistics, as {allocs frees live slabs} for the lval pool and then
+   the lenv pool. The arguments are ignored, as with "gc". */
+lval* builtin_pools(lenv* e, lval* a) {
+  lval_del(a);
+  lval* v = lval_qexpr();
+  v = lval_add(v, lpool_stats(&lval_pool));
+  v = lval_add(v, lpool_stats(&lenv_pool));
+  return v;
+}
+#endif
+#ifdef LISPY_VM_STATS
+/* Bytecode instructions run so far, as a count for each opcode in the
+   order of the LOP_* enum, and then how many of the fused and folded ones
+   fell back to the ordinary code. The arguments are ignored, as with "gc". */
+lval* builtin_vm(lenv* e, lval* a) {
+  lval_del(a);
+  lval* v = lval_qexpr();
+  for (int i = 0; i < LOP_COUNT; i++) { v = lval_add(v, lval_num(lvm.counts[i])); }
+  return lval_add(v, lval_num(lvm.misses));
+}
+#endif
 
 void lenv_add_builtins(lenv* e) {
   /* Special def function. */
@@ -748,172 +3824,709 @@ void lenv_add_builtins(lenv* e) {
   lenv_add_builtin(e, "\\", builtin_lambda);
 
   /* List functions */
-  lenv_add_builtin(e, "list", builtin_list);
-  lenv_add_builtin(e, "head", builtin_head);
-  lenv_add_builtin(e, "tail", builtin_tail);
+  lenv_add_builtin_argv(e, "list", builtin_list);
+  lenv_add_builtin_argv(e, "head", builtin_head);
+  lenv_add_builtin_argv(e, "tail", builtin_tail);
   lenv_add_builtin(e, "eval", builtin_eval);
-  lenv_add_builtin(e, "join", builtin_join);
-  lenv_add_builtin(e, "cons", builtin_cons);
-  lenv_add_builtin(e, "len",  builtin_len);
-  lenv_add_builtin(e, "init", builtin_init);
+  lenv_add_builtin_argv(e, "join", builtin_join);
+  lenv_add_builtin_argv(e, "cons", builtin_cons);
+  lenv_add_builtin_argv(e, "len",  builtin_len);
+  lenv_add_builtin_argv(e, "init", builtin_init);
+  lenv_add_builtin_argv(e, "nth",  builtin_nth);
 
   /* Aritmetic functions. */
-  lenv_add_builtin(e, "+", builtin_add);
-  lenv_add_builtin(e, "-", builtin_sub);
-  lenv_add_builtin(e, "*", builtin_mul);
-  lenv_add_builtin(e, "/", builtin_div);
-  lenv_add_builtin(e, "%", builtin_mod);
-  lenv_add_builtin(e, "^", builtin_pow);
+  lenv_add_builtin_argv(e, "+", builtin_add);
+  lenv_add_builtin_argv(e, "-", builtin_sub);
+  lenv_add_builtin_argv(e, "*", builtin_mul);
+  lenv_add_builtin_argv(e, "/", builtin_div);
+  lenv_add_builtin_argv(e, "%", builtin_mod);
+  lenv_add_builtin_argv(e, "^", builtin_pow);
 
   /* Comparison functions. */
-  lenv_add_builtin(e, "==", builtin_eq);
-  lenv_add_builtin(e, "!=", builtin_neq);
+  lenv_add_builtin_argv(e, "==", builtin_eq);
+  lenv_add_builtin_argv(e, "!=", builtin_neq);
 
   /* Ordering functions. */
-  lenv_add_builtin(e, ">", builtin_gt);
-  lenv_add_builtin(e, "<", builtin_lt);
-  lenv_add_builtin(e, ">=", builtin_gte);
-  lenv_add_builtin(e, "<=", builtin_lte);
-}
-
-lval* lval_call(lenv* e, lval* f, lval* a) {
-  if (f->data.fn.builtin) { return f->data.fn.builtin(e, a); }
-
-  int given = a->data.sexprs.count;
-  int total = f->data.fn.formals->data.sexprs.count;
-
-  // /* Assign each argument to each formal in order. */
-  // for (int = 0; i < a->count; i++) {
-  //   lenv_put(f->data.fn.env, f->data.fn.formals->data.sexprs.cell[i],
-  //            a->data.sexprs.cell[i]);
-  // }
-
-  while (a->data.sexprs.count) {
-    if (f->data.fn.formals->data.sexprs.count == 0) {
-      lval_del(a);
-      return lval_err("Function passed too many arguments. "
-                      "Expected %i, got %i.", total, given);
-    }
-
-    lval* sym = lval_pop(f->data.fn.formals, 0);
-    /* Special case to deal with '&' */
-    if (strcmp(sym->data.sym, "&") == 0) {
-      /* Ensure '&' is followed by another symbol. */
-      if (f->data.fn.formals->data.sexprs.count != 1) {
-        lval_del(a);
-        return lval_err("Function format invalid. "
-                        "Symbol \"&\" must be followed by a single symbol.");
-      }
-
-      /* Next formal should be bound to remaining arguments. */
-      lval* nsym = lval_pop(f->data.fn.formals, 0);
-      lenv_put(f->data.fn.env, nsym, builtin_list(e, a));
-      lval_del(sym);
-      lval_del(nsym);
-      break;
-    }
+  lenv_add_builtin_argv(e, ">", builtin_gt);
+  lenv_add_builtin_argv(e, "<", builtin_lt);
+  lenv_add_builtin_argv(e, ">=", builtin_gte);
+  lenv_add_builtin_argv(e, "<=", builtin_lte);
+
+#ifdef LISPY_GC
+  /* Collector statistics. */
+  lenv_add_builtin(e, "gc", builtin_gc);
+#endif
+
+#ifdef LISPY_ALLOC_STATS
+  /* Allocator statistics. */
+  lenv_add_builtin(e, "pools", builtin_pools);
+#endif
+
+#ifdef LISPY_VM_STATS
+  /* Bytecode statistics. */
+  lenv_add_builtin(e, "vm", builtin_vm);
+#endif
+}
 
-    lval* val = lval_pop(a, 0);
+/* Proper tail calls.
 
-    lenv_put(f->data.fn.env, sym, val);
+   What a call comes to is often just another expression to evaluate: the
+   branch "if" picks, the Q-expression given to "eval", or the body of a
+   lambda once its arguments are bound. Rather than evaluate it there and
+   then, one C frame deeper, lval_apply_tail hands it back, and lval_eval
+   and lvm_run carry on with it in their own loop, entering the lambda's
+   frame in place of their last, see ltail_enter. So a recursive loop runs
+   in constant C stack however many times it goes round. */
 
-    lval_del(sym);
-    lval_del(val);
+lval* lval_partial(lval* f, lval* args);
+
+/* Apply the S-expression "v", whose children are already evaluated, up to
+   the point where a tail call would be made. Then it returns NULL with
+   "*f" set to the lambda to call and "*x" to its arguments, or with "*f"
+   NULL and "*x" the expression to evaluate in the current frame. */
+lval* lval_apply_tail(lenv* e, lval* v, lval** x, lval** f) {
+  /* Check for errors. */
+  for (int i = 0; i < v->data.sexprs->count; i++) {
+    if (lval_type(v->data.sexprs->cell[i]) == LVAL_ERR) { return lval_take(v, i); }
   }
 
-  lval_del(a);
+  /* Empty expression */
+  if (v->data.sexprs->count == 0) { return v; }
+
+  /* Single expression */
+  if (v->data.sexprs->count == 1) { return lval_take(v, 0); }
+
+  /* Ensure first element is a function. */
+  lval* fn = lval_pop(v, 0);
+  if (lval_type(fn) != LVAL_FUN) {
+    lval_del(fn);
+    lval_del(v);
+    return lval_err("S-expression doesn't begin with a function!");
+  }
+
+  if (fn->data.fn->builtin == builtin_if || fn->data.fn->builtin == builtin_eval) {
+    lval* exp = fn->data.fn->builtin == builtin_if ? lval_if_branch(v)
+                                                   : lval_eval_expr(v);
+    lval_del(fn);
+    if (lval_type(exp) == LVAL_ERR) { return exp; }
+    *x = exp;
+    *f = NULL;
+    return NULL;
+  }
+
+  /* Call builtin with operator */
+  if (fn->data.fn->builtin) {
+    lval* result = fn->data.fn->builtin(e, v);
+    lval_del(fn);
+    return result;
+  }
+  if (fn->data.fn->builtin_argv) {
+    lval* result = fn->data.fn->builtin_argv(e, v->data.sexprs->cell,
+                                             v->data.sexprs->count);
+    lval_del(v);
+    lval_del(fn);
+    return result;
+  }
+
+  /* A partial application is its lambda, with the arguments given so far
+     in front of these. */
+  int fresh = v->data.sexprs->count;
+  if (fn->data.fn->callee) {
+    lval* bound = fn->data.fn->args;
+    int given = bound->data.sexprs->count;
+    lval* all = lval_new(LVAL_SEXPR);
+    all->data.sexprs = lcells_new(given + fresh);
+    for (int i = 0; i < given; i++) {
+      lval_add(all, lval_copy(bound->data.sexprs->cell[i]));
+    }
+    for (int i = 0; i < fresh; i++) {
+      lval_add(all, lval_copy(v->data.sexprs->cell[i]));
+    }
+    lval_del(v);
+    v = all;
+
+    lval* callee = lval_copy(fn->data.fn->callee);
+    lval_del(fn);
+    fn = callee;
+  }
+
+  /* Check the arguments fit the formals, up to any "&". */
+  lval* formals = fn->data.fn->formals;
+  int total = formals->data.sexprs->count;
+  int given = v->data.sexprs->count;
+  int amp = 0;
+  while (amp < total && formals->data.sexprs->cell[amp]->data.sym != lsym_amp) {
+    amp++;
+  }
+
+  if (given > total && amp == total) {
+    lval* err = lval_err("Function passed too many arguments. "
+                         "Expected %i, got %i.", total - (given - fresh), fresh);
+    lval_del(fn);
+    lval_del(v);
+    return err;
+  }
 
-  /* If "&" remains in formal list, bind to empty list. */
-  if (f->data.fn.formals->data.sexprs.count > 0 &&
-      strcmp(f->data.fn.formals->data.sexprs.cell[0]->data.sym, "&") == 0) {
+  /* Return partially evaluated function. */
+  if (given < amp) { return lval_partial(fn, v); }
 
-    /* Check to ensure that & is not passed invalidly. */
-    if (f->data.fn.formals->data.sexprs.count != 2) {
+  if (amp < total && amp + 2 != total) {
+    lval_del(fn);
+    lval_del(v);
+    if (given > amp) {
       return lval_err("Function format invalid. "
-                      "Symbol \"&\" not followed by a single symbol.");
+                      "Symbol \"&\" must be followed by a single symbol.");
     }
+    return lval_err("Function format invalid. "
+                    "Symbol \"&\" not followed by a single symbol.");
+  }
+
+  *x = v;
+  *f = fn;
+  return NULL;
+}
+
+/* Partially apply the lambda "f" to "args", fewer than it takes. */
+lval* lval_partial(lval* f, lval* args) {
+  lval* formals = f->data.fn->formals;
+  int given = args->data.sexprs->count;
+
+  lval* p = lval_new(LVAL_FUN);
+  p->data.fn = lpool_alloc(&lfun_pool);
+  p->data.fn->builtin = NULL;
+  p->data.fn->builtin_argv = NULL;
+  p->data.fn->env = NULL;
+  p->data.fn->formals = lval_slice(lval_copy(formals), given,
+                                   formals->data.sexprs->count - given);
+  p->data.fn->body = lval_copy(f->data.fn->body);
+  p->data.fn->code = NULL;
+  p->data.fn->aot = NULL;
+  p->data.fn->callee = f;
+  p->data.fn->args = args;
+  return p;
+}
 
-    /* Pop and delete "&" symbol. */
-    lval_del(lval_pop(f->data.fn.formals, 0));
+/* The body of the lambda "f", ready to evaluate. */
+lval* lval_body(lval* f) {
+  lval* x = lval_unshare(lval_copy(f->data.fn->body));
+  x->type = LVAL_SEXPR;
+  return x;
+}
 
-    /* Pop next symbol and create empty list. */
-    lval* sym = lval_pop(f->data.fn.formals, 0);
-    lval* val = lval_qexpr();
+#ifdef LISPY_JIT
+/* Native code.
+
+   Once a lambda has been called LJIT_THRESHOLD times its body is compiled
+   to x86-64, if it is built only from integer arithmetic, comparisons,
+   "if" and calls to itself, by stitching together a fixed template for
+   each. Values are plain longs in rax. Anything the template can't deal
+   with, an overflow or a division by zero, bails out through ljit_bail,
+   and the call is made again by the interpreter, which is safe as such a
+   body has no side effects. The names it uses are looked up when it is
+   compiled and checked again, by ljit_guard, each time native code is
+   entered from the interpreter, so redefining one just goes back to
+   interpreting. Under dynamic scope they can't be looked up ahead of
+   time, so nothing is compiled. Build with -DLISPY_JIT for this. */
+#define LJIT_THRESHOLD 1000
+#define LJIT_MAX_ARGS 4
+
+enum { LJIT_ADD, LJIT_SUB, LJIT_MUL, LJIT_DIV, LJIT_MOD,
+       LJIT_EQ, LJIT_NE, LJIT_GT, LJIT_LT, LJIT_GE, LJIT_LE,
+       LJIT_IF, LJIT_SELF };
+
+/* The builtins native code knows, with what each compiles to. */
+struct { lbuiltin_argv fn; int op; } ljit_builtins[] = {
+  { builtin_add, LJIT_ADD }, { builtin_sub, LJIT_SUB },
+  { builtin_mul, LJIT_MUL }, { builtin_div, LJIT_DIV },
+  { builtin_mod, LJIT_MOD }, { builtin_eq, LJIT_EQ },
+  { builtin_neq, LJIT_NE }, { builtin_gt, LJIT_GT },
+  { builtin_lt, LJIT_LT }, { builtin_gte, LJIT_GE },
+  { builtin_lte, LJIT_LE },
+};
+
+_Thread_local jmp_buf ljit_escape;
+
+void ljit_bail(void) { longjmp(ljit_escape, 1); }
+
+void ljit_del(ljit* j) {
+  if (j->code) { munmap(j->code, j->size); }
+  free(j->guards);
+  free(j);
+}
 
-    /* Bind to environment and delete. */
-    lenv_put(f->data.fn.env, sym, val);
-    lval_del(sym);
-    lval_del(val);
+/* The value "name" has in "e", without taking a reference. */
+lval* ljit_lookup(lenv* e, char* name) {
+  for (; e; e = e->parent) {
+    int i = lenv_find(e, name);
+    if (i >= 0) { return e->vals[i]; }
   }
+  return NULL;
+}
 
-  if (f->data.fn.formals->data.sexprs.count == 0) {
-    /* Evaluate if all arguments are bound. */
-    f->data.fn.env->parent = e;
-    return builtin_eval(f->data.fn.env, lval_add(lval_sexpr(),
-                                         lval_copy(f->data.fn.body)));
-  } else {
-    /* Return partially evaluated function. */
-    return lval_copy(f);
+/* What native code makes of "v", the value of a name in operator
+   position, or -1 if it can't call it. */
+int ljit_op(lval* v, lcode* self) {
+  if (!v || lval_type(v) != LVAL_FUN) { return -1; }
+  lfun* fn = v->data.fn;
+  if (!lfun_is_builtin(fn)) {
+    return fn->code == self && !fn->callee ? LJIT_SELF : -1;
+  }
+  if (fn->builtin == builtin_if) { return LJIT_IF; }
+  for (int i = 0; i < sizeof(ljit_builtins) / sizeof(ljit_builtins[0]); i++) {
+    if (fn->builtin_argv == ljit_builtins[i].fn) { return ljit_builtins[i].op; }
+  }
+  return -1;
+}
+
+/* Whether the names native code relies on still mean what they did. */
+int ljit_guard(ljit* j, lenv* e, lcode* self) {
+  for (int i = 0; i < j->nguards; i++) {
+    if (ljit_op(ljit_lookup(e, j->guards[i].name), self) != j->guards[i].op) {
+      return 0;
+    }
   }
+  return 1;
 }
 
-lval* lval_eval_sexpr(lenv* e, lval* v) {
-  /* Evaulate children. */
-  for (int i = 0; i < v->data.sexprs.count; i++) {
-    v->data.sexprs.cell[i] = lval_eval(e, v->data.sexprs.cell[i]);
+/* Code being generated. "depth" is the number of values pushed on the
+   machine stack, to keep it aligned at calls, and "body" is where the
+   body starts, after the arguments are stored. */
+typedef struct {
+  unsigned char* bytes;
+  int count;
+  int capacity;
+  int* bails;
+  int nbails;
+  int depth;
+  int body;
+  lval* formals;
+  lenv* env;
+  lcode* self;
+  ljit* jit;
+} ljit_gen;
+
+void ljit_emit(ljit_gen* g, int n, ...) {
+  if (g->count + n > g->capacity) {
+    g->capacity = (g->count + n) * 2;
+    g->bytes = realloc(g->bytes, g->capacity);
   }
+  va_list va;
+  va_start(va, n);
+  for (int i = 0; i < n; i++) { g->bytes[g->count++] = va_arg(va, int); }
+  va_end(va);
+}
 
-  /* Check for errors. */
-  for (int i = 0; i < v->data.sexprs.count; i++) {
-    if (v->data.sexprs.cell[i]->type == LVAL_ERR) { return lval_take(v, i); }
+/* Immediates are little-endian. */
+void ljit_emit_long(ljit_gen* g, long x) {
+  for (int i = 0; i < 8; i++) {
+    ljit_emit(g, 1, (int)(((unsigned long)x >> (8 * i)) & 0xff));
   }
+}
 
-  /* Empty expression */
-  if (v->data.sexprs.count == 0) { return v; }
+void ljit_emit_int(ljit_gen* g, int x) {
+  for (int i = 0; i < 4; i++) {
+    ljit_emit(g, 1, (int)(((unsigned)x >> (8 * i)) & 0xff));
+  }
+}
 
-  /* Single expression */
-  if (v->data.sexprs.count == 1) { return lval_take(v, 0); }
+void ljit_patch(ljit_gen* g, int at, int target) {
+  int rel = target - (at + 4);
+  memcpy(g->bytes + at, &rel, 4);
+}
 
-  /* Ensure first element is a function. */
-  lval* f = lval_pop(v, 0);
-  if (f->type != LVAL_FUN) {
-    lval_del(f);
-    lval_del(v);
-    return lval_err("S-expression doesn't begin with a function!");
+/* A conditional jump, by its second opcode byte, to the bail out code. */
+void ljit_emit_bail(ljit_gen* g, int cc) {
+  ljit_emit(g, 2, 0x0f, cc);
+  g->bails = realloc(g->bails, sizeof(int) * (g->nbails + 1));
+  g->bails[g->nbails++] = g->count;
+  ljit_emit_int(g, 0);
+}
+
+void ljit_push(ljit_gen* g) { ljit_emit(g, 1, 0x50); g->depth++; }
+void ljit_pop_rcx(ljit_gen* g) {
+  /* mov rcx, rax; pop rax */
+  ljit_emit(g, 4, 0x48, 0x89, 0xc1, 0x58);
+  g->depth--;
+}
+
+int ljit_expr(ljit_gen* g, lval* x, int tail);
+
+/* Compile the items of "v" as the S-expression they make, as "if"
+   branches and the body are evaluated. */
+int ljit_items(ljit_gen* g, lval* v, int tail) {
+  if (lval_len(v) == 1 && lval_type(lval_index(v, 0)) != LVAL_QEXPR) {
+    return ljit_expr(g, lval_index(v, 0), tail);
   }
+  if (lval_len(v) < 2 || lval_type(lval_index(v, 0)) != LVAL_SYM) { return 0; }
 
-  /* Call builtin with operator */
-  lval* result = lval_call(e, f, v);
-  lval_del(f);
+  lval* name = lval_index(v, 0);
+  for (int i = 0; i < lval_len(g->formals); i++) {
+    if (lval_index(g->formals, i)->data.sym == name->data.sym) { return 0; }
+  }
+  int op = ljit_op(ljit_lookup(g->env, name->data.sym), g->self);
+  if (op < 0) { return 0; }
+
+  ljit* j = g->jit;
+  j->guards = realloc(j->guards, sizeof(*j->guards) * (j->nguards + 1));
+  j->guards[j->nguards].name = name->data.sym;
+  j->guards[j->nguards].op = op;
+  j->nguards++;
+
+  int argc = lval_len(v) - 1;
+  switch (op) {
+    case LJIT_IF: {
+      lval* yes = lval_index(v, 2);
+      lval* no = argc == 3 ? lval_index(v, 3) : NULL;
+      if (argc != 3 || lval_type(yes) != LVAL_QEXPR ||
+          lval_type(no) != LVAL_QEXPR) {
+        return 0;
+      }
+      if (!ljit_expr(g, lval_index(v, 1), 0)) { return 0; }
+
+      /* test rax, rax; jz else */
+      ljit_emit(g, 5, 0x48, 0x85, 0xc0, 0x0f, 0x84);
+      int to_else = g->count;
+      ljit_emit_int(g, 0);
+      if (!ljit_items(g, yes, tail)) { return 0; }
+
+      /* jmp end */
+      ljit_emit(g, 1, 0xe9);
+      int to_end = g->count;
+      ljit_emit_int(g, 0);
+      ljit_patch(g, to_else, g->count);
+      if (!ljit_items(g, no, tail)) { return 0; }
+      ljit_patch(g, to_end, g->count);
+      return 1;
+    }
+
+    case LJIT_SELF: {
+      int n = lval_len(g->formals);
+      if (argc != n) { return 0; }
+      for (int i = 0; i < n; i++) {
+        if (!ljit_expr(g, lval_index(v, i + 1), 0)) { return 0; }
+        ljit_push(g);
+      }
+
+      if (tail) {
+        /* Pop into the slots and start again: pop rax; mov [rbp-8k], rax */
+        for (int i = n - 1; i >= 0; i--) {
+          ljit_emit(g, 5, 0x58, 0x48, 0x89, 0x45, -8 * (i + 1) & 0xff);
+          g->depth--;
+        }
+        ljit_emit(g, 1, 0xe9);
+        ljit_emit_int(g, 0);
+        ljit_patch(g, g->count - 4, g->body);
+        return 1;
+      }
+
+      /* Pop into rdi, rsi, rdx, rcx, keeping the stack aligned. */
+      static const int pops[] = { 0x5f, 0x5e, 0x5a, 0x59 };
+      for (int i = n - 1; i >= 0; i--) {
+        ljit_emit(g, 1, pops[i]);
+        g->depth--;
+      }
+      int pad = g->depth % 2;
+      if (pad) { ljit_emit(g, 4, 0x48, 0x83, 0xec, 0x08); }
+      ljit_emit(g, 1, 0xe8);
+      ljit_emit_int(g, 0);
+      ljit_patch(g, g->count - 4, 0);
+      if (pad) { ljit_emit(g, 4, 0x48, 0x83, 0xc4, 0x08); }
+      return 1;
+    }
+
+    case LJIT_EQ: case LJIT_NE: case LJIT_GT:
+    case LJIT_LT: case LJIT_GE: case LJIT_LE: {
+      static const int sets[] = { 0x94, 0x95, 0x9f, 0x9c, 0x9d, 0x9e };
+      if (argc != 2) { return 0; }
+      if (!ljit_expr(g, lval_index(v, 1), 0)) { return 0; }
+      ljit_push(g);
+      if (!ljit_expr(g, lval_index(v, 2), 0)) { return 0; }
+      ljit_pop_rcx(g);
+      /* cmp rax, rcx; setcc al; movzx eax, al */
+      ljit_emit(g, 9, 0x48, 0x39, 0xc8, 0x0f, sets[op - LJIT_EQ], 0xc0,
+                0x0f, 0xb6, 0xc0);
+      return 1;
+    }
+
+    default: {
+      if (!ljit_expr(g, lval_index(v, 1), 0)) { return 0; }
+      /* A lone argument to "-" is negated: neg rax; jo bail */
+      if (argc == 1 && op == LJIT_SUB) {
+        ljit_emit(g, 3, 0x48, 0xf7, 0xd8);
+        ljit_emit_bail(g, 0x80);
+      }
+
+      for (int i = 2; i <= argc; i++) {
+        ljit_push(g);
+        if (!ljit_expr(g, lval_index(v, i), 0)) { return 0; }
+        ljit_pop_rcx(g);
+        switch (op) {
+          /* add, sub or imul rax, rcx; jo bail */
+          case LJIT_ADD: ljit_emit(g, 3, 0x48, 0x01, 0xc8); break;
+          case LJIT_SUB: ljit_emit(g, 3, 0x48, 0x29, 0xc8); break;
+          case LJIT_MUL: ljit_emit(g, 4, 0x48, 0x0f, 0xaf, 0xc1); break;
+          default:
+            /* Zero and LONG_MIN / -1 are left to the interpreter:
+               test rcx, rcx; jz bail; cmp rcx, -1; jne ok;
+               mov rdx, LONG_MIN; cmp rax, rdx; je bail */
+            ljit_emit(g, 3, 0x48, 0x85, 0xc9);
+            ljit_emit_bail(g, 0x84);
+            ljit_emit(g, 6, 0x48, 0x83, 0xf9, 0xff, 0x75, 0x13);
+            ljit_emit(g, 2, 0x48, 0xba);
+            ljit_emit_long(g, LONG_MIN);
+            ljit_emit(g, 3, 0x48, 0x39, 0xd0);
+            ljit_emit_bail(g, 0x84);
+            /* cqo; idiv rcx, and for "%" mov rax, rdx */
+            ljit_emit(g, 5, 0x48, 0x99, 0x48, 0xf7, 0xf9);
+            if (op == LJIT_MOD) { ljit_emit(g, 3, 0x48, 0x89, 0xd0); }
+            continue;
+        }
+        ljit_emit_bail(g, 0x80);
+      }
+      return 1;
+    }
+  }
+}
+
+/* Compile code leaving the value of "x" in rax. */
+int ljit_expr(ljit_gen* g, lval* x, int tail) {
+  switch (lval_type(x)) {
+    case LVAL_NUM:
+      if (!lval_is_long(x)) { return 0; }
+      /* mov rax, x */
+      ljit_emit(g, 2, 0x48, 0xb8);
+      ljit_emit_long(g, lval_long(x));
+      return 1;
+
+    case LVAL_SYM:
+      for (int i = 0; i < lval_len(g->formals); i++) {
+        if (lval_index(g->formals, i)->data.sym == x->data.sym) {
+          /* mov rax, [rbp-8k] */
+          ljit_emit(g, 4, 0x48, 0x8b, 0x45, -8 * (i + 1) & 0xff);
+          return 1;
+        }
+      }
+      return 0;
+
+    case LVAL_SEXPR: return ljit_items(g, x, tail);
+  }
+  return 0;
+}
+
+/* Compile the lambda "f", giving a jit with no code if it can't be. */
+ljit* ljit_compile(lval* f) {
+  lfun* fn = f->data.fn;
+  ljit* j = calloc(1, sizeof(ljit));
+  j->nargs = lval_len(fn->formals);
+  if (j->nargs > LJIT_MAX_ARGS) { return j; }
+  for (int i = 0; i < j->nargs; i++) {
+    if (lval_index(fn->formals, i)->data.sym == lsym_amp) { return j; }
+  }
+
+  ljit_gen g = { .formals = fn->formals, .env = fn->env, .self = fn->code,
+                 .jit = j };
+
+  /* push rbp; mov rbp, rsp; sub rsp, 32; then the arguments into their
+     slots, mov [rbp-8k], rdi/rsi/rdx/rcx. */
+  ljit_emit(&g, 8, 0x55, 0x48, 0x89, 0xe5, 0x48, 0x83, 0xec, 0x20);
+  static const int regs[] = { 0x7d, 0x75, 0x55, 0x4d };
+  for (int i = 0; i < LJIT_MAX_ARGS; i++) {
+    ljit_emit(&g, 4, 0x48, 0x89, regs[i], -8 * (i + 1) & 0xff);
+  }
+  g.body = g.count;
+  int ok = ljit_items(&g, fn->body, 1);
+
+  /* leave; ret, and then where bailing out jumps to:
+     and rsp, -16; mov rax, ljit_bail; call rax */
+  ljit_emit(&g, 2, 0xc9, 0xc3);
+  for (int i = 0; i < g.nbails; i++) { ljit_patch(&g, g.bails[i], g.count); }
+  ljit_emit(&g, 6, 0x48, 0x83, 0xe4, 0xf0, 0x48, 0xb8);
+  ljit_emit_long(&g, (long)(uintptr_t)ljit_bail);
+  ljit_emit(&g, 2, 0xff, 0xd0);
+
+  if (ok) {
+    j->size = g.count;
+    j->code = mmap(NULL, j->size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (j->code == MAP_FAILED) {
+      j->code = NULL;
+    } else {
+      memcpy(j->code, g.bytes, g.count);
+      mprotect(j->code, j->size, PROT_READ | PROT_EXEC);
+    }
+  }
+  free(g.bytes);
+  free(g.bails);
+  return j;
+}
+
+int ljit_run(ljit* j, long* args, long* result) {
+  if (setjmp(ljit_escape)) { return 0; }
+  typedef long (*lnative)(long, long, long, long);
+  *result = ((lnative)j->code)(args[0], args[1], args[2], args[3]);
+  return 1;
+}
+
+/* Call "f" with "args" in native code, compiling it if it's now hot.
+   Returns NULL, leaving "args" alone, if the call is for the interpreter
+   to make. */
+lval* ljit_call(lval* f, lval* args) {
+  lcode* c = f->data.fn->code;
+  if (!c->jit) {
+    if (++c->calls < LJIT_THRESHOLD) { return NULL; }
+    c->jit = ljit_compile(f);
+  }
+
+  ljit* j = c->jit;
+  if (!j->code || lval_len(args) != j->nargs) { return NULL; }
+  long a[LJIT_MAX_ARGS] = { 0 };
+  for (int i = 0; i < j->nargs; i++) {
+    lval* x = lval_index(args, i);
+    if (!lval_is_long(x)) { return NULL; }
+    a[i] = lval_long(x);
+  }
+  if (!ljit_guard(j, f->data.fn->env, c)) { return NULL; }
+
+  long result;
+  if (!ljit_run(j, a, &result)) { return NULL; }
+  lval_del(args);
+  return lval_num(result);
+}
+#endif
+
+lval* lval_call(lenv* e, lval* f, lval* args);
+
+/* Call "f", whose body lispyc compiled to C, with "args". The body hands
+   back its tail calls rather than making them, so like lval_eval this
+   enters each in place of the last while the callee is compiled too. */
+lval* laot_run(lenv* e, lval* f, lval* args) {
+  ltail t = { .f = NULL };
+  lval* x;
+
+  e = ltail_enter(&t, e, f, args);
+  lval* result = f->data.fn->aot(e, &x);
+  while (!result) {
+    result = lval_apply_tail(e, x, &x, &f);
+    if (result) { break; }
+
+    /* "if" and "eval" leave an expression to evaluate here. */
+    if (!f) {
+      if (lval_type(x) != LVAL_SEXPR) {
+        result = lval_eval(e, x);
+        break;
+      }
+      x = lval_eval_items(e, x);
+      continue;
+    }
+
+    if (!f->data.fn->aot) {
+      result = lval_call(e, f, x);
+      break;
+    }
+    e = ltail_enter(&t, e, f, x);
+    result = f->data.fn->aot(e, &x);
+  }
+
+  ltail_leave(&t);
   return result;
 }
 
-lval* lval_eval(lenv* e, lval* v) {
-  /* If symbol return associated value */
-  if (v->type == LVAL_SYM) {
-    lval* x = lenv_get(e, v);
-    lval_del(v);
-    return x;
+/* Call the lambda "f" from "e" with "args", as they come from
+   lval_apply_tail, and return what the call comes to. */
+lval* lval_call(lenv* e, lval* f, lval* args) {
+  if (f->data.fn->aot) { return laot_run(e, f, args); }
+  if (f->data.fn->code) { lfun_refresh(e, f); }
+#ifdef LISPY_JIT
+  if (f->data.fn->code && !lopts.dynamic_scope) {
+    lval* result = ljit_call(f, args);
+    if (result) {
+      lval_del(f);
+      return result;
+    }
   }
+#endif
 
-  /* Evaluate s-expressions. */
-  if (v->type == LVAL_SEXPR) { return lval_eval_sexpr(e, v); }
+  lframe a;
+  lframe_bind(&a, e, f, args);
+  lval* result = f->data.fn->code ? lvm_run(&a.env, f->data.fn->code)
+                                  : lval_eval(&a.env, lval_body(f));
+  lframe_done(&a);
+  lval_del(f);
+  return result;
+}
+
+/* Apply the S-expression "v", whose children are already evaluated. */
+lval* lval_apply(lenv* e, lval* v) {
+  lval* x;
+  lval* f;
+  lval* result = lval_apply_tail(e, v, &x, &f);
+  if (result) { return result; }
 
-  /* All other lval types remain the same. */
+  if (!f) { return lval_eval(e, x); }
+  return lval_call(e, f, x);
+}
+
+/* Evaluate the children of the S-expression "v". */
+lval* lval_eval_items(lenv* e, lval* v) {
+  v = lval_unshare(v);
+  for (int i = 0; i < v->data.sexprs->count; i++) {
+    v->data.sexprs->cell[i] = lval_eval(e, v->data.sexprs->cell[i]);
+  }
   return v;
 }
 
+lval* lval_eval(lenv* e, lval* v) {
+  ltail t = { .f = NULL };
+  lval* result = NULL;
+
+  while (!result) {
+    /* If symbol return associated value */
+    if (lval_type(v) == LVAL_SYM) {
+      result = lenv_get(e, v);
+      lval_del(v);
+      break;
+    }
+
+    /* All other lval types remain the same. */
+    if (lval_type(v) != LVAL_SEXPR) {
+      result = v;
+      break;
+    }
+
+    lval* f;
+    result = lval_apply_tail(e, lval_eval_items(e, v), &v, &f);
+    if (result || !f) { continue; }
+
+    /* Compiled code makes its own tail calls. */
+    if (f->data.fn->code) {
+      result = lval_call(e, f, v);
+      break;
+    }
+    e = ltail_enter(&t, e, f, v);
+    v = lval_body(f);
+  }
+
+  ltail_leave(&t);
+  return result;
+}
+
+/* The parsers for the language, made on first use by lgrammar. */
+mpc_parser_t* lgrammar_parsers[8];
+
+/* The parser for a line of input. */
+mpc_parser_t* lgrammar(void) {
+  mpc_parser_t** p = lgrammar_parsers;
+  if (p[7]) { return p[7]; }
 
-/* Main application. */
-int main(int argc, char** argv) {
   // Create some parsers.
-  mpc_parser_t* Number = mpc_new("number");
-  mpc_parser_t* Symbol = mpc_new("symbol");
-  mpc_parser_t* String = mpc_new("string");
-  mpc_parser_t* Sexpr = mpc_new("sexpr");
-  mpc_parser_t* Qexpr = mpc_new("qexpr");
-  mpc_parser_t* Expr = mpc_new("expr");
-  mpc_parser_t* Lispy = mpc_new("lispy");
+  mpc_parser_t* Number = p[0] = mpc_new("number");
+  mpc_parser_t* Symbol = p[1] = mpc_new("symbol");
+  mpc_parser_t* String = p[2] = mpc_new("string");
+  mpc_parser_t* Comment = p[3] = mpc_new("comment");
+  mpc_parser_t* Sexpr = p[4] = mpc_new("sexpr");
+  mpc_parser_t* Qexpr = p[5] = mpc_new("qexpr");
+  mpc_parser_t* Expr = p[6] = mpc_new("expr");
+  mpc_parser_t* Lispy = p[7] = mpc_new("lispy");
 
   // Define the language.
   mpca_lang(MPCA_LANG_DEFAULT,
@@ -921,17 +4534,151 @@ int main(int argc, char** argv) {
       number    : /-?[0-9]+(\\.[0-9]+)?/  ;                 \
       string    : /\"(\\\\.|[^\"])*\"/ ;                    \
       symbol    : /[a-zA-Z0-9_+\\-*\\/\\^%\\\\=<>!&]+/ ;    \
+      comment   : /#[^\\r\\n]*/ ;                           \
       sexpr     : '(' <expr>* ')' ;                         \
       qexpr     : '{' <expr>* '}' ;                         \
       expr      : <number> | <string> | <symbol> |          \
-                  <sexpr> | <qexpr>;                        \
+                  <comment> | <sexpr> | <qexpr>;            \
       lispy     : /^/ <expr>* /$/ ;                         \
     ",
-    Number, Symbol, String, Sexpr, Qexpr, Expr, Lispy);
+    Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
+
+  return Lispy;
+}
+
+void lgrammar_cleanup(void) {
+  mpc_parser_t** p = lgrammar_parsers;
+  if (p[7]) {
+    mpc_cleanup(8, p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7]);
+  }
+}
+
+/* Ahead of time compilation.
+
+   lispyc translates a program to C that runs on this interpreter. Each
+   line becomes a function evaluating its expressions in place, and so
+   does the body of each lambda written out as (\ {formals} {body}), see
+   laot_run. Whatever a call turns out to be is left to laot_call, so the
+   program means just what it does at the REPL. Literals are read in once
+   at startup, by laot_read. */
+
+/* The value of the literal whose source is "src". */
+lval* laot_read(lenv* e, char* src) {
+  mpc_result_t r;
+  if (!mpc_parse("<lispyc>", src, lgrammar(), &r)) {
+    mpc_err_delete(r.error);
+    return lval_err("Bad literal %s.", src);
+  }
+
+  lval* x = lval_read(r.output);
+  mpc_ast_delete(r.output);
+  lval_resolve(e, NULL, NULL, x);
+  return lval_take(x, 0);
+}
+
+/* The slot of the local "sym" in the frame "e". */
+int laot_slot(lenv* e, lval* sym) {
+  return lenv_find(e, sym->data.sym);
+}
+
+/* Whether the "n" values at "v" are a call to a builtin taking "argv",
+   with no errors among the arguments. */
+static inline int laot_is_argv(lval** v, int n) {
+  if (n < 2 || lval_type(v[0]) != LVAL_FUN || !v[0]->data.fn->builtin_argv) {
+    return 0;
+  }
+  for (int i = 1; i < n; i++) {
+    if (lval_type(v[i]) == LVAL_ERR) { return 0; }
+  }
+  return 1;
+}
+
+/* Whether "f" and "cond" are an "if" that can be taken in place. */
+static inline int laot_is_if(lval* f, lval* cond) {
+  return lval_type(f) == LVAL_FUN && f->data.fn->builtin == builtin_if &&
+    lval_type(cond) == LVAL_NUM;
+}
+
+lval* laot_sexpr(lval** v, int n) {
+  lval* x = lval_new(LVAL_SEXPR);
+  x->data.sexprs = lcells_new(n);
+  for (int i = 0; i < n; i++) { lval_add(x, v[i]); }
+  return x;
+}
+
+/* Apply the "n" values at "v", which it takes over, as an S-expression. */
+lval* laot_call(lenv* e, lval** v, int n) {
+  if (!laot_is_argv(v, n)) { return lval_apply(e, laot_sexpr(v, n)); }
+
+  lval* x = v[0]->data.fn->builtin_argv(e, v + 1, n - 1);
+  for (int i = 0; i < n; i++) { lval_del(v[i]); }
+  return x;
+}
+
+/* The same for a call in tail position, which unless it is a builtin
+   taking "argv" is handed back in "*next", to be made by laot_run. */
+lval* laot_tail(lenv* e, lval** v, int n, lval** next) {
+  if (laot_is_argv(v, n)) { return laot_call(e, v, n); }
+  *next = laot_sexpr(v, n);
+  return NULL;
+}
+
+/* Make a lambda from the values at "v", a function and its formals and
+   body, and if the function is still the builtin lambda, give it "aot" as
+   its body compiled. */
+lval* laot_lambda(lenv* e, lval** v, laot_body aot) {
+  int lambda = lval_type(v[0]) == LVAL_FUN &&
+    v[0]->data.fn->builtin == builtin_lambda;
+  lval* f = laot_call(e, v, 3);
+  if (lambda && lval_type(f) == LVAL_FUN) { f->data.fn->aot = aot; }
+  return f;
+}
+
+lenv* laot_init(void) {
+  lsym_init();
+  lenv* e = lenv_new();
+  lenv_add_builtins(e);
+  return e;
+}
+
+void laot_print(lval* x) {
+  lval_println(x);
+  lval_del(x);
+}
+
+void laot_done(lenv* e, lval** k, int n) {
+  for (int i = 0; i < n; i++) { lval_del(k[i]); }
+  lenv_del(e);
+  lgrammar_cleanup();
+}
+
+/* Main application. */
+#ifndef LISPY_NO_MAIN
+int main(int argc, char** argv) {
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--dynamic-scope") == 0) {
+      lopts.dynamic_scope = 1;
+    } else if (strcmp(argv[i], "--tree-walk") == 0) {
+      lopts.tree_walk = 1;
+    } else if (strcmp(argv[i], "--no-fuse") == 0) {
+      lopts.no_fuse = 1;
+    } else if (strcmp(argv[i], "--no-fold") == 0) {
+      lopts.no_fold = 1;
+    } else if (strcmp(argv[i], "--dump-fold") == 0) {
+      lopts.dump_fold = 1;
+    } else {
+      fprintf(stderr, "Unknown option \"%s\".\n", argv[i]);
+      return 1;
+    }
+  }
+
+  mpc_parser_t* Lispy = lgrammar();
 
   puts("Lispy version 0.0.1");
   puts("Press ^C to exit.");
 
+  lsym_init();
+
   lenv* e = lenv_new();
   lenv_add_builtins(e);
 
@@ -944,9 +4691,14 @@ int main(int argc, char** argv) {
     if (mpc_parse("<stdin>", input, Lispy, &r)) {
       /* lval result = eval(r.output); */
       /* lval_println(result); */
-      lval* x = lval_eval(e, lval_read(r.output));
+      lval* x = lval_read(r.output);
+      lval_resolve(e, NULL, NULL, x);
+      x = lval_eval(e, x);
       lval_println(x);
       lval_del(x);
+#ifdef LISPY_GC
+      lgc_maybe_collect(e);
+#endif
       mpc_ast_delete(r.output);
     } else {
       mpc_err_print(r.error);
@@ -958,6 +4710,7 @@ int main(int argc, char** argv) {
 
   lenv_del(e);
 
-  mpc_cleanup(4, Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
+  lgrammar_cleanup();
   return 0;
 }
+#endif